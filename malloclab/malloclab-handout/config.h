@@ -58,9 +58,42 @@
 #define ALIGNMENT 8  
 
 /* 
- * Maximum heap size in bytes 
+ * Maximum heap size in bytes. Large generated traces need more than the
+ * default, e.g. make CFLAGS="-Wall -O2 -pthread" MAX_HEAP=4294967296
+ * (after a make clean). memlib reserves address space for a heap of this
+ * size per arena of the mm package, and up to MEM_NUM_ARENAS of them must
+ * fit in size_t, so large heaps need a 64-bit build. mem_sbrk takes an
+ * int, so no single request can grow a heap by more than INT_MAX bytes.
  */
+#ifndef MAX_HEAP
 #define MAX_HEAP (20*(1<<20))  /* 20 MB */
+#endif
+
+/*
+ * Maximum number of independent heap regions (arenas) modeled by memlib,
+ * each holding up to MAX_HEAP bytes. mem_set_arenas selects how many are
+ * reserved. mem_sbrk always extends arena 0.
+ */
+#define MEM_NUM_ARENAS 16
+
+/*
+ * Maximum number of live mappings handed out by mem_map at once
+ */
+#define MEM_MAX_MAPPINGS 1024
+
+/*
+ * Number of times each thread replays its part of a trace in the
+ * parallel replay mode (mdriver -p), so that short traces run long
+ * enough to be timed
+ */
+#define PAR_ROUNDS 50
+
+/*
+ * Number of times each trace is replayed when measuring the latency of
+ * every request (mdriver -L), so that the tail percentiles are based on
+ * enough samples
+ */
+#define LAT_ROUNDS 20
 
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
@@ -0,0 +1,407 @@
+/*
+ * gentrace.c - Generates synthetic trace files for mdriver.
+ *
+ * The shipped traces are small, so this tool writes balanced traces of
+ * any length in the same .rep format. Every block is allocated once, may
+ * be reallocated a few times, and is freed when its lifetime runs out
+ * (or at the end of the trace). Block sizes, lifetimes and the way
+ * reallocated blocks grow are each drawn from a distribution given on
+ * the command line:
+ *
+ *   size distributions (-s, in bytes):
+ *     fixed:c1,c2,...        one of the size classes c1, c2, ... uniformly
+ *     uniform:min,max        uniform in [min, max]
+ *     powerlaw:min,max,a     bounded power law, density ~ size^-a
+ *     bimodal:s,l,p          around s, or around l with probability p
+ *                            (each mode is uniform within +-25%)
+ *
+ *   lifetime distributions (-l, in requests until the block is freed):
+ *     fixed:n, uniform:min,max, powerlaw:min,max,a, exp:mean
+ *
+ *   realloc growth (-g):
+ *     mul:f                  the block grows by a factor of f
+ *     add:n                  the block grows by n bytes
+ *     rand                   the new size is drawn from the size distribution
+ *
+ * For example, ten million requests of small, mostly short-lived blocks
+ * with a few large buffers that keep growing:
+ *
+ *   gentrace -n 10000000 -s powerlaw:8,65536,1.8 -l exp:2000 \
+ *            -r 0.05 -g mul:1.5 -o big.rep
+ *
+ * The peak number of live payload bytes is printed on stderr, as a hint
+ * for the MAX_HEAP that mdriver needs to run the trace.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <math.h>
+
+#define MAX_CLASSES 64          /* max number of size classes for fixed: */
+
+/* A probability distribution parsed from the command line */
+typedef struct {
+    enum {FIXED, UNIFORM, POWERLAW, BIMODAL, EXP} kind;
+    int nvals;                  /* number of values in vals */
+    double vals[MAX_CLASSES];   /* the parameters of the distribution */
+} dist_t;
+
+/* A live block, waiting in the death queue until it is freed */
+typedef struct {
+    unsigned long long death;   /* request number at which it is freed */
+    int id;                     /* id of the block in the trace */
+    int size;                   /* current payload size */
+} block_t;
+
+/* The death queue, a binary min-heap of the live blocks ordered by death */
+static block_t *queue;
+static int queue_len, queue_cap;
+
+/* State of the random number generator (xorshift64*) */
+static unsigned long long rng_state = 88172645463325252ULL;
+
+static void parse_dist(char *spec, dist_t *dist, char *what);
+static double draw(dist_t *dist);
+static double rand_unit(void);
+static int clamp_size(double size, int max_size);
+static void queue_push(block_t *block);
+static void queue_pop(void);
+static void queue_fix(int i);
+static void usage(void);
+
+int main(int argc, char **argv)
+{
+    int c;
+    long long num_ops = 100000;     /* number of requests to generate (-n) */
+    double realloc_frac = 0;        /* fraction of reallocs (-r) */
+    int max_size = 1 << 24;         /* cap on block sizes (-m) */
+    char *outname = NULL;           /* output file, stdout if not set (-o) */
+    dist_t sizes, lifetimes;
+    enum {MUL, ADD, RAND} grow = MUL;
+    double grow_by = 2;
+    unsigned long long seed = 1;
+
+    FILE *out, *ops;
+    block_t block, *victim;
+    long long num_reqs = 0;         /* number of requests generated so far */
+    int num_ids = 0;                /* number of blocks allocated so far */
+    unsigned long long live = 0;    /* number of live payload bytes */
+    unsigned long long peak = 0;    /* peak of live */
+    int size;
+
+    parse_dist("powerlaw:8,4096,2", &sizes, "size");
+    parse_dist("exp:1000", &lifetimes, "lifetime");
+
+    while ((c = getopt(argc, argv, "n:s:l:r:g:m:S:o:h")) != -1) {
+        switch (c) {
+        case 'n': /* Number of requests */
+            num_ops = atoll(optarg);
+            break;
+        case 's': /* Size distribution */
+            parse_dist(optarg, &sizes, "size");
+            break;
+        case 'l': /* Lifetime distribution */
+            parse_dist(optarg, &lifetimes, "lifetime");
+            break;
+        case 'r': /* Fraction of requests that are reallocs */
+            realloc_frac = atof(optarg);
+            break;
+        case 'g': /* How reallocated blocks grow */
+            if (!strncmp(optarg, "mul:", 4)) {
+                grow = MUL;
+                grow_by = atof(optarg + 4);
+            }
+            else if (!strncmp(optarg, "add:", 4)) {
+                grow = ADD;
+                grow_by = atof(optarg + 4);
+            }
+            else if (!strcmp(optarg, "rand")) {
+                grow = RAND;
+            }
+            else {
+                fprintf(stderr, "Bad realloc growth: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'm': /* Largest block size */
+            max_size = atoi(optarg);
+            break;
+        case 'S': /* Seed of the random number generator */
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'o': /* Output file */
+            outname = optarg;
+            break;
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (num_ops < 1 || num_ops > INT_MAX || max_size < 1 ||
+        realloc_frac < 0 || realloc_frac >= 1) {
+        usage();
+        exit(1);
+    }
+    rng_state ^= seed * 0x9e3779b97f4a7c15ULL;
+
+    /*
+     * The header holds counts we only know at the end, so the requests
+     * are first written to a temporary file
+     */
+    if ((ops = tmpfile()) == NULL) {
+        perror("tmpfile");
+        exit(1);
+    }
+
+    while (num_reqs + queue_len < num_ops) {
+        if (queue_len > 0 && queue[0].death <= (unsigned long long)num_reqs) {
+            /* The oldest block has run out of time */
+            fprintf(ops, "f %d\n", queue[0].id);
+            live -= queue[0].size;
+            queue_pop();
+        }
+        else if (queue_len > 0 && rand_unit() < realloc_frac) {
+            /* Grow some live block */
+            victim = &queue[(int)(rand_unit() * queue_len)];
+            if (grow == MUL)
+                size = clamp_size(victim->size * grow_by, max_size);
+            else if (grow == ADD)
+                size = clamp_size(victim->size + grow_by, max_size);
+            else
+                size = clamp_size(draw(&sizes), max_size);
+            fprintf(ops, "r %d %d\n", victim->id, size);
+            live = live - victim->size + size;
+            victim->size = size;
+        }
+        else {
+            /* Allocate a new block */
+            block.id = num_ids++;
+            block.size = clamp_size(draw(&sizes), max_size);
+            block.death = num_reqs + 1 + (unsigned long long)draw(&lifetimes);
+            fprintf(ops, "a %d %d\n", block.id, block.size);
+            live += block.size;
+            queue_push(&block);
+        }
+        peak = (live > peak) ? live : peak;
+        num_reqs++;
+    }
+
+    /* Free the blocks that are still alive, in order of death */
+    while (queue_len > 0) {
+        fprintf(ops, "f %d\n", queue[0].id);
+        queue_pop();
+        num_reqs++;
+    }
+
+    /* Write the header followed by the requests */
+    if (outname == NULL)
+        out = stdout;
+    else if ((out = fopen(outname, "w")) == NULL) {
+        perror(outname);
+        exit(1);
+    }
+    fprintf(out, "%d\n%d\n%lld\n%d\n",
+            (peak > INT_MAX) ? INT_MAX : (int)peak, num_ids, num_reqs, 1);
+    rewind(ops);
+    while ((c = getc(ops)) != EOF)
+        putc(c, out);
+    if (ferror(ops) || fclose(out) != 0) {
+        perror("gentrace");
+        exit(1);
+    }
+    fclose(ops);
+
+    fprintf(stderr, "gentrace: %lld requests, %d blocks, peak live %llu bytes\n",
+            num_reqs, num_ids, peak);
+    return 0;
+}
+
+/*
+ * parse_dist - Parse a distribution spec like "uniform:8,64" into dist,
+ *     exiting with an error message if it is malformed
+ */
+static void parse_dist(char *spec, dist_t *dist, char *what)
+{
+    static struct {
+        char *name;
+        int kind;
+        int nvals;               /* number of parameters, -1 for any */
+    } kinds[] = {
+        {"fixed", FIXED, -1},
+        {"uniform", UNIFORM, 2},
+        {"powerlaw", POWERLAW, 3},
+        {"bimodal", BIMODAL, 3},
+        {"exp", EXP, 1},
+    };
+    char *p, *end;
+    int i;
+    size_t len;
+
+    p = strchr(spec, ':');
+    len = p ? (size_t)(p - spec) : strlen(spec);
+    for (i = 0; i < (int)(sizeof(kinds) / sizeof(kinds[0])); i++) {
+        if (strlen(kinds[i].name) == len && !strncmp(spec, kinds[i].name, len))
+            break;
+    }
+    if (p == NULL || i == (int)(sizeof(kinds) / sizeof(kinds[0])))
+        goto bad;
+
+    dist->kind = kinds[i].kind;
+    dist->nvals = 0;
+    for (p++; *p != '\0'; p = end + (*end == ',')) {
+        if (dist->nvals == MAX_CLASSES)
+            goto bad;
+        dist->vals[dist->nvals++] = strtod(p, &end);
+        if (end == p || (*end != ',' && *end != '\0'))
+            goto bad;
+    }
+    if (dist->nvals == 0 ||
+        (kinds[i].nvals >= 0 && dist->nvals != kinds[i].nvals))
+        goto bad;
+    if (dist->kind == BIMODAL && (dist->vals[2] < 0 || dist->vals[2] > 1))
+        goto bad;
+    if ((dist->kind == UNIFORM || dist->kind == POWERLAW) &&
+        (dist->vals[0] < 0 || dist->vals[1] < dist->vals[0]))
+        goto bad;
+    if (dist->kind == POWERLAW && dist->vals[0] <= 0)
+        goto bad;
+    return;
+
+ bad:
+    fprintf(stderr, "Bad %s distribution: %s\n", what, spec);
+    exit(1);
+}
+
+/*
+ * draw - Draw a random value from a distribution
+ */
+static double draw(dist_t *dist)
+{
+    double lo, hi, a, u, mode;
+
+    switch (dist->kind) {
+    case FIXED:
+        return dist->vals[(int)(rand_unit() * dist->nvals)];
+
+    case UNIFORM:
+        return dist->vals[0] +
+            floor(rand_unit() * (dist->vals[1] - dist->vals[0] + 1));
+
+    case POWERLAW:
+        /* Invert the CDF of the power law bounded to [lo, hi] */
+        lo = dist->vals[0];
+        hi = dist->vals[1];
+        a = dist->vals[2];
+        u = rand_unit();
+        if (fabs(a - 1) < 1e-9)
+            return floor(lo * pow(hi / lo, u));
+        return floor(pow(pow(lo, 1 - a) + u * (pow(hi, 1 - a) - pow(lo, 1 - a)),
+                         1 / (1 - a)));
+
+    case BIMODAL:
+        mode = (rand_unit() < dist->vals[2]) ? dist->vals[1] : dist->vals[0];
+        return floor(mode * (0.75 + 0.5 * rand_unit()));
+
+    case EXP:
+        return floor(-dist->vals[0] * log(1 - rand_unit()));
+    }
+    return 0;
+}
+
+/*
+ * rand_unit - Return a uniformly distributed random number in [0, 1)
+ */
+static double rand_unit(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return ((rng_state * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * clamp_size - Round a drawn size to a valid request size in [1, max_size]
+ */
+static int clamp_size(double size, int max_size)
+{
+    if (size < 1)
+        return 1;
+    if (size > max_size)
+        return max_size;
+    return (int)size;
+}
+
+/*
+ * queue_push - Add a copy of block to the death queue
+ */
+static void queue_push(block_t *block)
+{
+    int i, parent;
+
+    if (queue_len == queue_cap) {
+        queue_cap = queue_cap ? 2 * queue_cap : 1024;
+        if ((queue = realloc(queue, queue_cap * sizeof(block_t))) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    for (i = queue_len++; i > 0; i = parent) {
+        parent = (i - 1) / 2;
+        if (queue[parent].death <= block->death)
+            break;
+        queue[i] = queue[parent];
+    }
+    queue[i] = *block;
+}
+
+/*
+ * queue_pop - Remove the block that dies first from the death queue
+ */
+static void queue_pop(void)
+{
+    queue[0] = queue[--queue_len];
+    queue_fix(0);
+}
+
+/*
+ * queue_fix - Sift the block at position i down to its place in the queue
+ */
+static void queue_fix(int i)
+{
+    int child;
+    block_t block = queue[i];
+
+    for (; (child = 2 * i + 1) < queue_len; i = child) {
+        if (child + 1 < queue_len && queue[child + 1].death < queue[child].death)
+            child++;
+        if (block.death <= queue[child].death)
+            break;
+        queue[i] = queue[child];
+    }
+    queue[i] = block;
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: gentrace [-h] [-n <ops>] [-s <dist>] [-l <dist>] "
+            "[-r <frac>] [-g <growth>]\n"
+            "                [-m <max size>] [-S <seed>] [-o <file>]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-n <ops>     Number of requests (default 100000).\n");
+    fprintf(stderr, "\t-s <dist>    Block sizes (default powerlaw:8,4096,2).\n");
+    fprintf(stderr, "\t-l <dist>    Block lifetimes in requests (default exp:1000).\n");
+    fprintf(stderr, "\t-r <frac>    Fraction of requests that are reallocs (default 0).\n");
+    fprintf(stderr, "\t-g <growth>  Realloc growth: mul:<f>, add:<n> or rand (default mul:2).\n");
+    fprintf(stderr, "\t-m <size>    Largest block size (default 16 MB).\n");
+    fprintf(stderr, "\t-S <seed>    Seed of the random number generator (default 1).\n");
+    fprintf(stderr, "\t-o <file>    Write the trace to <file> instead of stdout.\n");
+    fprintf(stderr, "\t-h           Print this message.\n");
+}
@@ -15,8 +15,10 @@
 #include <assert.h>
 #include <float.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "mm.h"
+#include "mmvariants.h"
 #include "memlib.h"
 #include "fsecs.h"
 #include "config.h"
@@ -37,11 +39,17 @@
  * The key compound data types 
  *****************************/
 
-/* Records the extent of each block's payload */
+/* 
+ * Records the extent of each block's payload. The ranges form a treap
+ * (a binary search tree on lo that is also a heap on prio), so finding
+ * the neighbours of a block takes O(log n) expected time.
+ */
 typedef struct range_t {
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    unsigned int prio;     /* treap priority, a hash of lo */
+    struct range_t *left;  /* ranges with lower addresses */
+    struct range_t *right; /* ranges with higher addresses */
 } range_t;
 
 /* Characterizes a single trace operation (allocator request) */
@@ -85,11 +93,61 @@ typedef struct {
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
 
+/* The heap statistics of the mm package on some trace */
+typedef struct {
+    mm_stats_t peak;     /* when the payload of the trace peaked */
+    mm_stats_t end;      /* after the last request */
+    mm_footprint_t footprint; /* pages spanned and live at the peak */
+} heap_stats_t;
+
+/* Holds the params and results of one thread of a parallel replay */
+typedef struct {
+    traceop_t *ops;      /* the requests replayed by this thread */
+    int num_ops;         /* number of requests in ops */
+    int num_ids;         /* number of alloc/realloc ids in the trace */
+    char **blocks;       /* this thread's ptrs returned by malloc/realloc */
+    pthread_barrier_t *barrier; /* released when all threads are ready */
+    struct timespec start; /* when this thread started replaying */
+    struct timespec end; /* when this thread finished replaying */
+    int failed;          /* set if the heap ran out of memory */
+} par_thread_t;
+
+/* Summarizes a parallel replay of some trace on several threads */
+typedef struct {
+    int valid;           /* 0 if the heap ran out of memory */
+    double ops;          /* number of ops replayed by all threads */
+    double secs;         /* wall clock secs until the last thread finished */
+    double min_kops;     /* throughput of the slowest thread */
+    double max_kops;     /* throughput of the fastest thread */
+    mm_lock_stats_t locks; /* heap lock statistics of the replay */
+} par_stats_t;
+
+/* 
+ * Histogram of the latencies of one type of request. Latencies are in
+ * ns and bucketed logarithmically: each power of two is split into
+ * 2^LAT_SUB_BITS linear sub-buckets, so the bucket a latency falls in
+ * is never more than 1/2^LAT_SUB_BITS wider than the latency itself.
+ */
+#define LAT_SUB_BITS 2
+#define LAT_BUCKETS  ((64 - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+
+typedef struct {
+    unsigned long count;                 /* number of requests */
+    unsigned long long max;              /* largest latency seen */
+    unsigned long buckets[LAT_BUCKETS];  /* number of requests per bucket */
+} lat_hist_t;
+
+/* Summarizes the latencies of each type of request on some trace */
+typedef struct {
+    lat_hist_t hists[3]; /* indexed by the traceop_t type */
+} lat_stats_t;
+
 /********************
  * Global variables
  *******************/
 int verbose = 0;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
+static const mm_variant_t *mm; /* the mm package being evaluated */
 char msg[MAXLINE];      /* for whenever we need to compose an error message */
 
 /* Directory where default tracefiles are found */
@@ -105,11 +163,15 @@ static char *default_tracefiles[] = {
  * Function prototypes 
  *********************/
 
-/* these functions manipulate range lists */
+/* these functions manipulate range trees */
 static int add_range(range_t **ranges, char *lo, int size, 
 		     int tracenum, int opnum);
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
+static unsigned int range_prio(char *lo);
+static range_t *range_insert(range_t *root, range_t *node);
+static range_t *range_erase(range_t *root, char *lo);
+static range_t *range_merge(range_t *left, range_t *right);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
@@ -122,12 +184,31 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
+static int eval_mm_api(range_t **ranges);
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges,
+			   int *peak_op);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_heap(trace_t *trace, int peak_op, heap_stats_t *stats);
+
+/* Routines for replaying a trace on several threads at once */
+static void eval_mm_parallel(trace_t *trace, int tracenum, int nthreads,
+			     int replicate, par_stats_t *stats);
+static void *par_replay(void *vargp);
+static double ts_diff(const struct timespec *from, const struct timespec *to);
+static void eval_mm_latency(trace_t *trace, lat_stats_t *stats);
+static void lat_add(lat_hist_t *hist, unsigned long long ns);
+static void lat_merge(lat_hist_t *dst, lat_hist_t *src);
+static unsigned long long lat_percentile(lat_hist_t *hist, double q);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void printparresults(int n, stats_t *stats, par_stats_t *par_stats);
+static void printlatresults(int n, stats_t *stats, lat_stats_t *lat_stats);
+static void printheapresults(int n, stats_t *stats, heap_stats_t *heap_stats);
+static void print_lat_hist(int tracenum, char *name, lat_hist_t *hist);
 static void usage(void);
+static int parse_backend(char *arg);
+static int parse_variants(char *arg, int *selected);
 static void unix_error(char *msg);
 static void malloc_error(int tracenum, int opnum, char *msg);
 static void app_error(char *msg);
@@ -150,6 +231,22 @@ int main(int argc, char **argv)
     int team_check = 1;  /* If set, check team structure (reset by -a) */
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    int par_threads = 0; /* If set, also replay on this many threads (-p) */
+    int par_replicate = 0; /* If set, each thread replays the whole trace (-r) */
+    par_stats_t *par_stats = NULL; /* parallel replay stats for each trace */
+    mm_lock_stats_t lock_stats;
+    int run_latency = 0; /* If set, also measure per-request latency (-L) */
+    lat_stats_t *lat_stats = NULL; /* latency histograms for each trace */
+    heap_stats_t *heap_stats = NULL; /* mm heap statistics for each trace */
+    int peak_op;                   /* request at which the payload peaked */
+    int backend = MEM_SIMULATED;   /* memlib backend (-b) */
+    int v;                         /* index of a variant in mm_variants */
+    int *selected;                 /* variants to evaluate (-m) */
+    int num_selected;
+    int variant_errors;            /* errors before the current variant */
+    double *variant_util, *variant_kops, *variant_perf;
+    FILE *profile_fp = NULL;       /* allocation profile output (-P) */
+    char profile_label[MAXLINE];
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -158,7 +255,16 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    selected = (int *)calloc(mm_num_variants, sizeof(int));
+    variant_util = (double *)calloc(mm_num_variants, sizeof(double));
+    variant_kops = (double *)calloc(mm_num_variants, sizeof(double));
+    variant_perf = (double *)calloc(mm_num_variants, sizeof(double));
+    if (!selected || !variant_util || !variant_kops || !variant_perf)
+	unix_error("variant calloc in main failed");
+    for (v = 0; v < mm_num_variants; v++)
+	selected[v] = 1;
+
+    while ((c = getopt(argc, argv, "f:t:b:m:P:hvVgaLlp:r")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -178,12 +284,41 @@ int main(int argc, char **argv)
 	    if (tracedir[strlen(tracedir)-1] != '/') 
 		strcat(tracedir, "/"); /* path always ends with "/" */
 	    break;
+        case 'b': /* Back the heap by real memory, see parse_backend */
+            if ((backend = parse_backend(optarg)) < 0) {
+		usage();
+		exit(1);
+	    }
+            break;
+        case 'm': /* Evaluate only these variants of the mm package */
+            if (parse_variants(optarg, selected) < 0) {
+		usage();
+		exit(1);
+	    }
+            break;
+        case 'P': /* Write the allocation profile of each trace as CSV */
+            if ((profile_fp = fopen(optarg, "w")) == NULL)
+		unix_error("ERROR: cannot open the -P file");
+            break;
         case 'a': /* Don't check team structure */
             team_check = 0;
             break;
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+        case 'L': /* Measure the latency of each request */
+            run_latency = 1;
+            break;
+        case 'p': /* Replay each trace on this many threads at once */
+            par_threads = atoi(optarg);
+            if (par_threads < 1) {
+		usage();
+		exit(1);
+	    }
+            break;
+        case 'r': /* With -p, every thread replays the whole trace */
+            par_replicate = 1;
+            break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -225,6 +360,10 @@ int main(int argc, char **argv)
 	    printf("Member 2 :%s:%s\n", team.name2, team.id2);
     }
 
+    num_selected = 0;
+    for (v = 0; v < mm_num_variants; v++)
+	num_selected += selected[v];
+
     /* 
      * If no -f command line arg, then use the entire set of tracefiles 
      * defined in default_traces[]
@@ -274,116 +413,225 @@ int main(int argc, char **argv)
     }
 
     /*
-     * Always run and evaluate the student's mm package
+     * Always run and evaluate the student's mm package, and with
+     * mdriver-variants each selected variant of it in turn
      */
     if (verbose > 1)
 	printf("\nTesting mm malloc\n");
 
-    /* Allocate the mm stats array, with one stats_t struct per tracefile */
+    /* Allocate the mm stats arrays, with one struct per tracefile */
     mm_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
     if (mm_stats == NULL)
 	unix_error("mm_stats calloc in main failed");
+    heap_stats = (heap_stats_t *)calloc(num_tracefiles, sizeof(heap_stats_t));
+    if (heap_stats == NULL)
+	unix_error("heap_stats calloc in main failed");
     
     /* Initialize the simulated memory system in memlib.c */
+    if (backend != MEM_SIMULATED && verbose)
+	printf("Using the real memlib backend\n");
+    mem_set_backend(backend);
+    mem_set_arenas(mm_num_arenas);
     mem_init(); 
 
-    /* Evaluate student's mm malloc package using the K-best scheme */
-    for (i=0; i < num_tracefiles; i++) {
-	trace = read_trace(tracedir, tracefiles[i]);
-	mm_stats[i].ops = trace->num_ops;
-	if (verbose > 1)
-	    printf("Checking mm_malloc for correctness, ");
-	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
-	if (mm_stats[i].valid) {
-	    if (verbose > 1)
-		printf("efficiency, ");
-	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
-	    speed_params.trace = trace;
-	    speed_params.ranges = ranges;
+    if (par_threads > 0) {
+	par_stats = (par_stats_t *)calloc(num_tracefiles, sizeof(par_stats_t));
+	if (par_stats == NULL)
+	    unix_error("par_stats calloc in main failed");
+    }
+    if (run_latency) {
+	lat_stats = (lat_stats_t *)calloc(num_tracefiles, sizeof(lat_stats_t));
+	if (lat_stats == NULL)
+	    unix_error("lat_stats calloc in main failed");
+    }
+    if (profile_fp != NULL) {
+	fprintf(profile_fp, "variant,trace,");
+	if (mm_variants[0].profile_dump(profile_fp, NULL) < 0)
+	    app_error("ERROR: -P requires an mm package built with MM_PROFILE");
+    }
+
+    for (v = 0; v < mm_num_variants; v++) {
+	if (!selected[v])
+	    continue;
+	mm = &mm_variants[v];
+	variant_errors = errors;
+	memset(mm_stats, 0, num_tracefiles * sizeof(stats_t));
+	memset(heap_stats, 0, num_tracefiles * sizeof(heap_stats_t));
+	if (num_selected > 1)
+	    printf("\nVariant %s:\n", mm->name);
+
+	/* Evaluate student's mm malloc package using the K-best scheme */
+	for (i=0; i < num_tracefiles; i++) {
+	    trace = read_trace(tracedir, tracefiles[i]);
+	    mm_stats[i].ops = trace->num_ops;
 	    if (verbose > 1)
-		printf("and performance.\n");
-	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+		printf("Checking mm_malloc for correctness, ");
+	    mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
+	    if (mm_stats[i].valid) {
+		if (verbose > 1)
+		    printf("efficiency, ");
+		mm_stats[i].util = eval_mm_util(trace, i, &ranges, &peak_op);
+		if (profile_fp != NULL) {
+		    /* The profile covers the requests of the util run */
+		    sprintf(profile_label, "%s,%s", mm->name, tracefiles[i]);
+		    mm->profile_dump(profile_fp, profile_label);
+		}
+		if (verbose)
+		    eval_mm_heap(trace, peak_op, &heap_stats[i]);
+		speed_params.trace = trace;
+		speed_params.ranges = ranges;
+		if (verbose > 1)
+		    printf("and performance.\n");
+		mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+	    }
+	    free_trace(trace);
 	}
-	free_trace(trace);
-    }
 
-    /* Display the mm results in a compact table */
-    if (verbose) {
-	printf("\nResults for mm malloc:\n");
-	printresults(num_tracefiles, mm_stats);
-	printf("\n");
-    }
+	/* Check the entry points that the traces do not use */
+	if (verbose > 1)
+	    printf("Checking mm_calloc, mm_memalign and mm_aligned_alloc.\n");
+	eval_mm_api(&ranges);
 
-    /* 
-     * Accumulate the aggregate statistics for the student's mm package 
-     */
-    secs = 0;
-    ops = 0;
-    util = 0;
-    numcorrect = 0;
-    for (i=0; i < num_tracefiles; i++) {
-	secs += mm_stats[i].secs;
-	ops += mm_stats[i].ops;
-	util += mm_stats[i].util;
-	if (mm_stats[i].valid)
-	    numcorrect++;
-    }
-    avg_mm_util = util/num_tracefiles;
+	/* Display the mm results in a compact table */
+	if (verbose) {
+	    printf("\nResults for %s malloc:\n", mm->name);
+	    printresults(num_tracefiles, mm_stats);
+	    printf("\nHeap statistics of %s malloc, in KB at peak payload:\n",
+		   mm->name);
+	    printheapresults(num_tracefiles, mm_stats, heap_stats);
+	    printf("\n");
+	}
 
-    /* 
-     * Compute and print the performance index 
-     */
-    if (errors == 0) {
-	avg_mm_throughput = ops/secs;
+	/*
+	 * Optionally replay the valid traces on several threads at once
+	 */
+	if (par_threads > 0) {
+	    if (mm->lock_stats(&lock_stats) < 0)
+		app_error("ERROR: -p requires a thread-safe mm package");
+
+	    for (i=0; i < num_tracefiles; i++) {
+		if (!mm_stats[i].valid)
+		    continue;
+		trace = read_trace(tracedir, tracefiles[i]);
+		eval_mm_parallel(trace, i, par_threads, par_replicate, 
+				 &par_stats[i]);
+		free_trace(trace);
+	    }
 
-	p1 = UTIL_WEIGHT * avg_mm_util;
-	if (avg_mm_throughput > AVG_LIBC_THRUPUT) {
-	    p2 = (double)(1.0 - UTIL_WEIGHT);
-	} 
-	else {
-	    p2 = ((double) (1.0 - UTIL_WEIGHT)) * 
-		(avg_mm_throughput/AVG_LIBC_THRUPUT);
+	    printf("Parallel replay of %s on %d threads:\n",
+		   par_replicate ? "whole traces" : "trace shards", par_threads);
+	    printparresults(num_tracefiles, mm_stats, par_stats);
+	    printf("\n");
+	}
+
+	/*
+	 * Optionally time every request of the valid traces
+	 */
+	if (run_latency) {
+	    for (i=0; i < num_tracefiles; i++) {
+		if (!mm_stats[i].valid)
+		    continue;
+		trace = read_trace(tracedir, tracefiles[i]);
+		eval_mm_latency(trace, &lat_stats[i]);
+		free_trace(trace);
+	    }
+
+	    printf("Latency of mm requests in ns:\n");
+	    printlatresults(num_tracefiles, mm_stats, lat_stats);
+	    printf("\n");
 	}
+
+	/* 
+	 * Accumulate the aggregate statistics for the student's mm package 
+	 */
+	secs = 0;
+	ops = 0;
+	util = 0;
+	numcorrect = 0;
+	for (i=0; i < num_tracefiles; i++) {
+	    secs += mm_stats[i].secs;
+	    ops += mm_stats[i].ops;
+	    util += mm_stats[i].util;
+	    if (mm_stats[i].valid)
+		numcorrect++;
+	}
+	avg_mm_util = util/num_tracefiles;
+
+	/* 
+	 * Compute and print the performance index 
+	 */
+	if (errors == variant_errors) {
+	    avg_mm_throughput = ops/secs;
+
+	    p1 = UTIL_WEIGHT * avg_mm_util;
+	    if (avg_mm_throughput > AVG_LIBC_THRUPUT) {
+		p2 = (double)(1.0 - UTIL_WEIGHT);
+	    } 
+	    else {
+		p2 = ((double) (1.0 - UTIL_WEIGHT)) * 
+		    (avg_mm_throughput/AVG_LIBC_THRUPUT);
+	    }
 	
-	perfindex = (p1 + p2)*100.0;
-	printf("Perf index = %.0f (util) + %.0f (thru) = %.0f/100\n",
-	       p1*100, 
-	       p2*100, 
-	       perfindex);
+	    perfindex = (p1 + p2)*100.0;
+	    printf("Perf index = %.0f (util) + %.0f (thru) = %.0f/100\n",
+		   p1*100, 
+		   p2*100, 
+		   perfindex);
 	
-    }
-    else { /* There were errors */
-	perfindex = 0.0;
-	printf("Terminated with %d errors\n", errors);
+	}
+	else { /* There were errors */
+	    perfindex = 0.0;
+	    printf("Terminated with %d errors\n", errors - variant_errors);
+	}
+
+	if (autograder) {
+	    printf("correct:%d\n", numcorrect);
+	    printf("perfidx:%.0f\n", perfindex);
+	}
+
+	variant_util[v] = avg_mm_util;
+	variant_kops[v] = secs > 0 ? ops / secs / 1e3 : 0;
+	variant_perf[v] = perfindex;
     }
 
-    if (autograder) {
-	printf("correct:%d\n", numcorrect);
-	printf("perfidx:%.0f\n", perfindex);
+    /* Compare the variants side by side */
+    if (num_selected > 1) {
+	printf("\nSummary of the mm variants:\n");
+	printf("%-20s%8s%10s%8s\n", "variant", "util", "Kops", "perf");
+	for (v = 0; v < mm_num_variants; v++) {
+	    if (selected[v])
+		printf("%-20s%7.0f%%%10.0f%8.0f\n", mm_variants[v].name,
+		       variant_util[v] * 100.0, variant_kops[v],
+		       variant_perf[v]);
+	}
     }
 
+    if (profile_fp != NULL)
+	fclose(profile_fp);
+
     exit(0);
 }
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps 
+ * The following routines manipulate the range tree, which keeps 
  * track of the extent of every allocated block payload. We use the 
- * range list to detect any overlapping allocated blocks.
+ * range tree to detect any overlapping allocated blocks.
  ****************************************************************/
 
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of 
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list. 
+ *     we create a range struct for this block and add it to the range tree. 
  */
 static int add_range(range_t **ranges, char *lo, int size, 
 		     int tracenum, int opnum)
 {
     char *hi = lo + size - 1;
-    range_t *p;
+    range_t *p, *pred, *succ;
     char msg[MAXLINE];
+    int arena;
 
     assert(size > 0);
 
@@ -395,36 +643,57 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
-	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
-		lo, hi, mem_heap_lo(), mem_heap_hi());
+    /* The payload must lie within the extent of its arena or a mapping */
+    if (!mem_in_heap(lo, hi)) {
+	if ((arena = mem_arena_of(lo)) >= 0)
+	    sprintf(msg, "Payload (%p:%p) lies outside arena %d (%p:%p)",
+		    lo, hi, arena, mem_arena_lo(arena), mem_arena_hi(arena));
+	else
+	    sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
+		    lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
         return 0;
     }
 
-    /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-	    sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-		    lo, hi, p->lo, p->hi);
-	    malloc_error(tracenum, opnum, msg);
-	    return 0;
-        }
+    /* 
+     * The payload must not overlap any other payloads. Since the
+     * payloads in the tree are disjoint, it is enough to check the
+     * payloads right below and right above lo.
+     */
+    pred = succ = NULL;
+    for (p = *ranges;  p != NULL; ) {
+	if (p->lo <= lo) {
+	    pred = p;
+	    p = p->right;
+	}
+	else {
+	    succ = p;
+	    p = p->left;
+	}
+    }
+    p = NULL;
+    if (pred != NULL && pred->hi >= lo)
+	p = pred;
+    else if (succ != NULL && succ->lo <= hi)
+	p = succ;
+    if (p != NULL) {
+	sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+		lo, hi, p->lo, p->hi);
+	malloc_error(tracenum, opnum, msg);
+	return 0;
     }
 
     /* 
      * Everything looks OK, so remember the extent of this block 
-     * by creating a range struct and adding it the range list.
+     * by creating a range struct and adding it the range tree.
      */
     if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
 	unix_error("malloc error in add_range");
-    p->next = *ranges;
     p->lo = lo;
     p->hi = hi;
-    *ranges = p;
+    p->prio = range_prio(lo);
+    p->left = p->right = NULL;
+    *ranges = range_insert(*ranges, p);
     return 1;
 }
 
@@ -433,19 +702,7 @@ static int add_range(range_t **ranges, char *lo, int size,
  */
 static void remove_range(range_t **ranges, char *lo)
 {
-    range_t *p;
-    range_t **prevpp = ranges;
-    int size;
-
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-	    *prevpp = p->next;
-            size = p->hi - p->lo + 1;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
-    }
+    *ranges = range_erase(*ranges, lo);
 }
 
 /*
@@ -453,16 +710,105 @@ static void remove_range(range_t **ranges, char *lo)
  */
 static void clear_ranges(range_t **ranges)
 {
-    range_t *p;
-    range_t *pnext;
+    range_t *p = *ranges;
 
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
+    if (p != NULL) {
+	clear_ranges(&p->left);
+	clear_ranges(&p->right);
+	free(p);
     }
     *ranges = NULL;
 }
 
+/*
+ * range_prio - Hash the payload address lo into a treap priority, so
+ *     that the tree stays balanced no matter in which order the mm
+ *     package hands out addresses
+ */
+static unsigned int range_prio(char *lo)
+{
+    unsigned long long x = (unsigned long long)(unsigned long)lo;
+
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return (unsigned int)x;
+}
+
+/*
+ * range_insert - Insert node into the tree rooted at root, rotating it
+ *     up while its priority is higher than its parent's. Returns the
+ *     new root.
+ */
+static range_t *range_insert(range_t *root, range_t *node)
+{
+    range_t *child;
+
+    if (root == NULL)
+	return node;
+    if (node->lo < root->lo) {
+	root->left = range_insert(root->left, node);
+	if (root->left->prio > root->prio) {
+	    child = root->left;
+	    root->left = child->right;
+	    child->right = root;
+	    root = child;
+	}
+    }
+    else {
+	root->right = range_insert(root->right, node);
+	if (root->right->prio > root->prio) {
+	    child = root->right;
+	    root->right = child->left;
+	    child->left = root;
+	    root = child;
+	}
+    }
+    return root;
+}
+
+/*
+ * range_erase - Remove and free the range starting at lo from the tree
+ *     rooted at root, if there is one. Returns the new root.
+ */
+static range_t *range_erase(range_t *root, char *lo)
+{
+    range_t *p;
+
+    if (root == NULL)
+	return NULL;
+    if (lo < root->lo)
+	root->left = range_erase(root->left, lo);
+    else if (lo > root->lo)
+	root->right = range_erase(root->right, lo);
+    else {
+	p = root;
+	root = range_merge(p->left, p->right);
+	free(p);
+    }
+    return root;
+}
+
+/*
+ * range_merge - Join two trees, where all of the ranges in left lie
+ *     below all of the ranges in right. Returns the new root.
+ */
+static range_t *range_merge(range_t *left, range_t *right)
+{
+    if (left == NULL)
+	return right;
+    if (right == NULL)
+	return left;
+    if (left->prio > right->prio) {
+	left->right = range_merge(left->right, right);
+	return left;
+    }
+    right->left = range_merge(left, right->left);
+    return right;
+}
+
 
 /**********************************************
  * The following routines manipulate tracefiles
@@ -584,12 +930,12 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     char *oldp;
     char *p;
     
-    /* Reset the heap and free any records in the range list */
+    /* Reset the heap and free any records in the range tree */
     mem_reset_brk();
     clear_ranges(ranges);
 
     /* Call the mm package's init function */
-    if (mm_init() < 0) {
+    if (mm->init() < 0) {
 	malloc_error(tracenum, 0, "mm_init failed.");
 	return 0;
     }
@@ -604,14 +950,14 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
         case ALLOC: /* mm_malloc */
 
 	    /* Call the student's malloc */
-	    if ((p = mm_malloc(size)) == NULL) {
+	    if ((p = mm->malloc(size)) == NULL) {
 		malloc_error(tracenum, i, "mm_malloc failed.");
 		return 0;
 	    }
 	    
 	    /* 
 	     * Test the range of the new block for correctness and add it 
-	     * to the range list if OK. The block must be  be aligned properly,
+	     * to the range tree if OK. The block must be  be aligned properly,
 	     * and must not overlap any currently allocated block. 
 	     */ 
 	    if (add_range(ranges, p, size, tracenum, i) == 0)
@@ -633,15 +979,15 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    
 	    /* Call the student's realloc */
 	    oldp = trace->blocks[index];
-	    if ((newp = mm_realloc(oldp, size)) == NULL) {
+	    if ((newp = mm->realloc(oldp, size)) == NULL) {
 		malloc_error(tracenum, i, "mm_realloc failed.");
 		return 0;
 	    }
 	    
-	    /* Remove the old region from the range list */
+	    /* Remove the old region from the range tree */
 	    remove_range(ranges, oldp);
 	    
-	    /* Check new block for correctness and add it to range list */
+	    /* Check new block for correctness and add it to range tree */
 	    if (add_range(ranges, newp, size, tracenum, i) == 0)
 		return 0;
 	    
@@ -653,7 +999,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    oldsize = trace->block_sizes[index];
 	    if (size < oldsize) oldsize = size;
 	    for (j = 0; j < oldsize; j++) {
-	      if (newp[j] != (index & 0xFF)) {
+	      if ((unsigned char)newp[j] != (index & 0xFF)) {
 		malloc_error(tracenum, i, "mm_realloc did not preserve the "
 			     "data from old block");
 		return 0;
@@ -671,7 +1017,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    /* Remove region from list and call student's free function */
 	    p = trace->blocks[index];
 	    remove_range(ranges, p);
-	    mm_free(p);
+	    mm->free(p);
 	    break;
 
 	default:
@@ -684,31 +1030,145 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     return 1;
 }
 
+/*
+ * eval_mm_api - Checks the mm entry points that the traces do not use:
+ *    that mm_calloc returns zeroed payloads, even over the dirty blocks
+ *    of earlier requests, and NULL if nmemb * size overflows, and that
+ *    mm_memalign and mm_aligned_alloc return payloads aligned as asked
+ *    and NULL for alignments that are not powers of two. The payloads
+ *    go through the same checks as those of the traces, and errors are
+ *    reported with a tracenum of -1. Returns 1 if all checks pass.
+ */
+#define API_MAX_BLOCKS 256
+
+static int eval_mm_api(range_t **ranges)
+{
+    static const int sizes[] = {1, 7, 24, 100, 1000, 4000, 40000, 300000};
+    const int num_sizes = sizeof(sizes) / sizeof(sizes[0]);
+    char *blocks[API_MAX_BLOCKS];
+    int num_blocks = 0;
+    int opnum = 0;
+    int i, j, k, size, fn;
+    size_t align;
+    char *p;
+
+    mem_reset_brk();
+    clear_ranges(ranges);
+    if (mm->init() < 0) {
+	malloc_error(-1, opnum, "mm_init failed.");
+	return 0;
+    }
+
+    /* Leave dirty free blocks behind for mm_calloc to reuse */
+    for (i = 0; i < num_sizes; i++) {
+	if ((blocks[i] = mm->malloc(sizes[i])) == NULL) {
+	    malloc_error(-1, opnum, "mm_malloc failed.");
+	    return 0;
+	}
+	memset(blocks[i], 0xa5, sizes[i]);
+	opnum++;
+    }
+    for (i = 0; i < num_sizes; i++)
+	mm->free(blocks[i]);
+
+    /* mm_calloc payloads must be zeroed */
+    for (i = 0; i < num_sizes; i++) {
+	for (j = 1; j <= 3; j += 2) {
+	    size = sizes[i] * j;
+	    if ((p = mm->calloc(j, sizes[i])) == NULL) {
+		malloc_error(-1, opnum, "mm_calloc failed.");
+		return 0;
+	    }
+	    if (!add_range(ranges, p, size, -1, opnum))
+		return 0;
+	    for (k = 0; k < size; k++) {
+		if (p[k] != 0) {
+		    sprintf(msg, "mm_calloc payload (%p) not zeroed at byte %d",
+			    p, k);
+		    malloc_error(-1, opnum, msg);
+		    return 0;
+		}
+	    }
+	    memset(p, 0xa5, size);
+	    blocks[num_blocks++] = p;
+	    opnum++;
+	}
+    }
+    if (mm->calloc((size_t)-1 / 2 + 1, 2) != NULL) {
+	malloc_error(-1, opnum, "mm_calloc did not fail on overflow.");
+	return 0;
+    }
+    opnum++;
+
+    /* mm_memalign and mm_aligned_alloc payloads must be aligned */
+    for (fn = 0; fn < 2; fn++) {
+	for (align = 1; align <= 8192; align *= 4) {
+	    for (i = 0; i < num_sizes; i += 2) {
+		p = fn ? mm->aligned_alloc(align, sizes[i]) :
+		    mm->memalign(align, sizes[i]);
+		if (p == NULL) {
+		    sprintf(msg, "%s(%u, %d) failed.",
+			    fn ? "mm_aligned_alloc" : "mm_memalign",
+			    (unsigned int)align, sizes[i]);
+		    malloc_error(-1, opnum, msg);
+		    return 0;
+		}
+		if ((size_t)p % align != 0) {
+		    sprintf(msg, "Payload address (%p) not aligned to %u bytes",
+			    p, (unsigned int)align);
+		    malloc_error(-1, opnum, msg);
+		    return 0;
+		}
+		if (!add_range(ranges, p, sizes[i], -1, opnum))
+		    return 0;
+		memset(p, 0xa5, sizes[i]);
+		blocks[num_blocks++] = p;
+		opnum++;
+	    }
+	}
+    }
+    if (mm->memalign(24, 8) != NULL || mm->aligned_alloc(0, 8) != NULL) {
+	malloc_error(-1, opnum, "Alignment that is not a power of two accepted.");
+	return 0;
+    }
+    opnum++;
+
+    assert(num_blocks <= API_MAX_BLOCKS);
+    for (i = 0; i < num_blocks; i++) {
+	remove_range(ranges, blocks[i]);
+	mm->free(blocks[i]);
+    }
+    return 1;
+}
+
 /* 
  * eval_mm_util - Evaluate the space utilization of the student's package
  *   The idea is to remember the high water mark "hwm" of the heap for 
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
+ *   peak size of the heap in bytes while running the student's malloc 
+ *   package on the trace. Note that mem_sbrk() allows the students to 
+ *   decrement the brk pointer, so we ask memlib for the high water 
+ *   mark of the heap rather than its final size. The request at which
+ *   the payload first reached its high water mark is put in *peak_op.
  *   
  */
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges,
+			   int *peak_op)
 {   
     int i;
     int index;
     int size, newsize, oldsize;
-    int max_total_size = 0;
-    int total_size = 0;
+    size_t max_total_size = 0;
+    size_t total_size = 0;
     char *p;
     char *newp, *oldp;
 
     /* initialize the heap and the mm malloc package */
     mem_reset_brk();
-    if (mm_init() < 0)
+    if (mm->init() < 0)
 	app_error("mm_init failed in eval_mm_util");
+    *peak_op = 0;
 
     for (i = 0;  i < trace->num_ops;  i++) {
         switch (trace->ops[i].type) {
@@ -717,7 +1177,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    index = trace->ops[i].index;
 	    size = trace->ops[i].size;
 
-	    if ((p = mm_malloc(size)) == NULL) 
+	    if ((p = mm->malloc(size)) == NULL) 
 		app_error("mm_malloc failed in eval_mm_util");
 	    
 	    /* Remember region and size */
@@ -729,8 +1189,10 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    total_size += size;
 	    
 	    /* Update statistics */
-	    max_total_size = (total_size > max_total_size) ?
-		total_size : max_total_size;
+	    if (total_size > max_total_size) {
+		max_total_size = total_size;
+		*peak_op = i;
+	    }
 	    break;
 
 	case REALLOC: /* mm_realloc */
@@ -739,7 +1201,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    oldsize = trace->block_sizes[index];
 
 	    oldp = trace->blocks[index];
-	    if ((newp = mm_realloc(oldp,newsize)) == NULL)
+	    if ((newp = mm->realloc(oldp,newsize)) == NULL)
 		app_error("mm_realloc failed in eval_mm_util");
 
 	    /* Remember region and size */
@@ -748,11 +1210,13 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    
 	    /* Keep track of current total size
 	     * of all allocated blocks */
-	    total_size += (newsize - oldsize);
+	    total_size = total_size - oldsize + newsize;
 	    
 	    /* Update statistics */
-	    max_total_size = (total_size > max_total_size) ?
-		total_size : max_total_size;
+	    if (total_size > max_total_size) {
+		max_total_size = total_size;
+		*peak_op = i;
+	    }
 	    break;
 
         case FREE: /* mm_free */
@@ -760,7 +1224,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    size = trace->block_sizes[index];
 	    p = trace->blocks[index];
 	    
-	    mm_free(p);
+	    mm->free(p);
 	    
 	    /* Keep track of current total size
 	     * of all allocated blocks */
@@ -774,7 +1238,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
         }
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    return ((double)max_total_size / (double)mem_peak_heapsize());
 }
 
 
@@ -790,7 +1254,7 @@ static void eval_mm_speed(void *ptr)
 
     /* Reset the heap and initialize the mm package */
     mem_reset_brk();
-    if (mm_init() < 0) 
+    if (mm->init() < 0) 
 	app_error("mm_init failed in eval_mm_speed");
 
     /* Interpret each trace request */
@@ -800,7 +1264,7 @@ static void eval_mm_speed(void *ptr)
         case ALLOC: /* mm_malloc */
             index = trace->ops[i].index;
             size = trace->ops[i].size;
-            if ((p = mm_malloc(size)) == NULL)
+            if ((p = mm->malloc(size)) == NULL)
 		app_error("mm_malloc error in eval_mm_speed");
             trace->blocks[index] = p;
             break;
@@ -809,7 +1273,7 @@ static void eval_mm_speed(void *ptr)
 	    index = trace->ops[i].index;
             newsize = trace->ops[i].size;
 	    oldp = trace->blocks[index];
-            if ((newp = mm_realloc(oldp,newsize)) == NULL)
+            if ((newp = mm->realloc(oldp,newsize)) == NULL)
 		app_error("mm_realloc error in eval_mm_speed");
             trace->blocks[index] = newp;
             break;
@@ -817,7 +1281,7 @@ static void eval_mm_speed(void *ptr)
         case FREE: /* mm_free */
             index = trace->ops[i].index;
             block = trace->blocks[index];
-            mm_free(block);
+            mm->free(block);
             break;
 
 	default:
@@ -825,6 +1289,335 @@ static void eval_mm_speed(void *ptr)
         }
 }
 
+/*
+ * eval_mm_heap - Replays a trace to sample the heap statistics of the
+ *    mm package with mm_stats and mm_footprint, right after request
+ *    peak_op (where the payload peaked) and after the last request.
+ *    Assumes that the trace has already been checked by eval_mm_valid.
+ */
+static void eval_mm_heap(trace_t *trace, int peak_op, heap_stats_t *stats)
+{
+    int i, index;
+    char *p;
+
+    mem_reset_brk();
+    if (mm->init() < 0)
+	app_error("mm_init failed in eval_mm_heap");
+
+    for (i = 0; i < trace->num_ops; i++) {
+	index = trace->ops[i].index;
+	switch (trace->ops[i].type) {
+	case ALLOC:
+	    if ((p = mm->malloc(trace->ops[i].size)) == NULL)
+		app_error("mm_malloc error in eval_mm_heap");
+	    trace->blocks[index] = p;
+	    break;
+	case REALLOC:
+	    if ((p = mm->realloc(trace->blocks[index], 
+				trace->ops[i].size)) == NULL)
+		app_error("mm_realloc error in eval_mm_heap");
+	    trace->blocks[index] = p;
+	    break;
+	case FREE:
+	    mm->free(trace->blocks[index]);
+	    break;
+	default:
+	    app_error("Nonexistent request type in eval_mm_heap");
+	}
+	if (i == peak_op) {
+	    mm->stats(&stats->peak);
+	    mm->footprint(&stats->footprint);
+	}
+    }
+    mm->stats(&stats->end);
+}
+
+/*
+ * eval_mm_parallel - Replays a trace on nthreads threads at once against
+ *    a single mm heap, to measure how the mm package scales. By default,
+ *    the ids of the trace are split into nthreads shards (id % nthreads)
+ *    and each thread replays the requests of its own shard, so the
+ *    threads together do the work of the trace once. If replicate is
+ *    set, every thread replays the whole trace instead. Each thread
+ *    replays its requests PAR_ROUNDS times. Assumes that the trace has
+ *    already been checked by eval_mm_valid. The replicas of -r need
+ *    nthreads times the live data of the trace, so a replay that runs
+ *    out of heap is marked invalid instead of ending the run.
+ */
+static void eval_mm_parallel(trace_t *trace, int tracenum, int nthreads,
+			     int replicate, par_stats_t *stats)
+{
+    int i, t;
+    double secs, kops;
+    pthread_t *tids;
+    par_thread_t *threads;
+    pthread_barrier_t barrier;
+    struct timespec first, last;
+
+    tids = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+    threads = (par_thread_t *)calloc(nthreads, sizeof(par_thread_t));
+    if (tids == NULL || threads == NULL)
+	unix_error("calloc in eval_mm_parallel failed");
+
+    /* Hand out the requests to the threads */
+    for (t = 0; t < nthreads; t++) {
+	threads[t].num_ids = trace->num_ids;
+	threads[t].barrier = &barrier;
+	threads[t].blocks = (char **)calloc(trace->num_ids, sizeof(char *));
+	threads[t].ops = (traceop_t *)calloc(trace->num_ops, sizeof(traceop_t));
+	if (threads[t].blocks == NULL || threads[t].ops == NULL)
+	    unix_error("calloc in eval_mm_parallel failed");
+	for (i = 0;  i < trace->num_ops;  i++) {
+	    if (replicate || trace->ops[i].index % nthreads == t)
+		threads[t].ops[threads[t].num_ops++] = trace->ops[i];
+	}
+    }
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (mm->init() < 0)
+	app_error("mm_init failed in eval_mm_parallel");
+
+    pthread_barrier_init(&barrier, NULL, nthreads + 1);
+    for (t = 0; t < nthreads; t++) {
+	if (pthread_create(&tids[t], NULL, par_replay, &threads[t]) != 0)
+	    unix_error("pthread_create in eval_mm_parallel failed");
+    }
+    pthread_barrier_wait(&barrier);
+    for (t = 0; t < nthreads; t++)
+	pthread_join(tids[t], NULL);
+    pthread_barrier_destroy(&barrier);
+
+    /* Summarize the replay */
+    stats->valid = 1;
+    for (t = 0; t < nthreads; t++) {
+	if (threads[t].failed)
+	    stats->valid = 0;
+    }
+    if (!stats->valid)
+	printf("Trace %d: out of heap memory on %d threads, skipped\n",
+	       tracenum, nthreads);
+    first = threads[0].start;
+    last = threads[0].end;
+    stats->ops = 0;
+    stats->min_kops = DBL_MAX;
+    stats->max_kops = 0;
+    for (t = 0; t < nthreads; t++) {
+	if (ts_diff(&threads[t].start, &first) > 0)
+	    first = threads[t].start;
+	if (ts_diff(&last, &threads[t].end) > 0)
+	    last = threads[t].end;
+	secs = ts_diff(&threads[t].start, &threads[t].end);
+	kops = ((double)threads[t].num_ops * PAR_ROUNDS / 1e3) / secs;
+	stats->ops += (double)threads[t].num_ops * PAR_ROUNDS;
+	stats->min_kops = (kops < stats->min_kops) ? kops : stats->min_kops;
+	stats->max_kops = (kops > stats->max_kops) ? kops : stats->max_kops;
+	if (verbose > 1)
+	    printf("Trace %d, thread %d: %d ops, %.0f Kops\n",
+		   tracenum, t, threads[t].num_ops * PAR_ROUNDS, kops);
+	free(threads[t].blocks);
+	free(threads[t].ops);
+    }
+    stats->secs = ts_diff(&first, &last);
+    mm->lock_stats(&stats->locks);
+
+    free(tids);
+    free(threads);
+}
+
+/*
+ * par_replay - The body of each thread of eval_mm_parallel. Waits for
+ *    all threads to be ready, then replays its requests PAR_ROUNDS times,
+ *    freeing whatever blocks are still allocated after each round. Stops
+ *    early and sets failed if a request returns NULL.
+ */
+static void *par_replay(void *vargp)
+{
+    par_thread_t *thread = (par_thread_t *)vargp;
+    traceop_t *op;
+    char *p;
+    int i, round;
+
+    pthread_barrier_wait(thread->barrier);
+    clock_gettime(CLOCK_MONOTONIC, &thread->start);
+
+    for (round = 0; round < PAR_ROUNDS; round++) {
+	for (i = 0;  i < thread->num_ops;  i++) {
+	    op = &thread->ops[i];
+	    switch (op->type) {
+
+	    case ALLOC: /* mm_malloc */
+		if ((p = mm->malloc(op->size)) == NULL)
+		    thread->failed = 1;
+		thread->blocks[op->index] = p;
+		break;
+
+	    case REALLOC: /* mm_realloc */
+		if ((p = mm->realloc(thread->blocks[op->index], op->size))
+		    == NULL)
+		    thread->failed = 1;
+		else
+		    thread->blocks[op->index] = p;
+		break;
+
+	    case FREE: /* mm_free */
+		mm->free(thread->blocks[op->index]);
+		thread->blocks[op->index] = NULL;
+		break;
+
+	    default:
+		app_error("Nonexistent request type in par_replay");
+	    }
+	    if (thread->failed)
+		break;
+	}
+
+	/* Free the blocks that an unbalanced trace leaves behind */
+	for (i = 0;  i < thread->num_ids;  i++) {
+	    if (thread->blocks[i] != NULL) {
+		mm->free(thread->blocks[i]);
+		thread->blocks[i] = NULL;
+	    }
+	}
+	if (thread->failed)
+	    break;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &thread->end);
+    return NULL;
+}
+
+/*
+ * ts_diff - Returns the number of secs from time from to time to
+ */
+static double ts_diff(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/*
+ * eval_mm_latency - Replays a trace LAT_ROUNDS times, timing every
+ *    single request of the mm package with the monotonic clock, and
+ *    adds the latencies to the histogram of each type of request. Unlike
+ *    eval_mm_speed, which only sees the total, this exposes the slow
+ *    requests (heap growth, long free list searches, realloc copies).
+ *    Assumes that the trace has already been checked by eval_mm_valid.
+ */
+static void eval_mm_latency(trace_t *trace, lat_stats_t *stats)
+{
+    int i, round, index;
+    char *p;
+    struct timespec start, end;
+
+    for (round = 0; round < LAT_ROUNDS; round++) {
+	/* Reset the heap and initialize the mm package */
+	mem_reset_brk();
+	if (mm->init() < 0)
+	    app_error("mm_init failed in eval_mm_latency");
+
+	for (i = 0;  i < trace->num_ops;  i++) {
+	    index = trace->ops[i].index;
+	    switch (trace->ops[i].type) {
+
+	    case ALLOC: /* mm_malloc */
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		p = mm->malloc(trace->ops[i].size);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if (p == NULL)
+		    app_error("mm_malloc error in eval_mm_latency");
+		trace->blocks[index] = p;
+		break;
+
+	    case REALLOC: /* mm_realloc */
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		p = mm->realloc(trace->blocks[index], trace->ops[i].size);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if (p == NULL)
+		    app_error("mm_realloc error in eval_mm_latency");
+		trace->blocks[index] = p;
+		break;
+
+	    case FREE: /* mm_free */
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		mm->free(trace->blocks[index]);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		break;
+
+	    default:
+		app_error("Nonexistent request type in eval_mm_latency");
+	    }
+	    lat_add(&stats->hists[trace->ops[i].type], 
+		    (end.tv_sec - start.tv_sec) * 1000000000ULL + 
+		    end.tv_nsec - start.tv_nsec);
+	}
+    }
+}
+
+/*
+ * lat_add - Adds a latency of ns nanoseconds to a histogram
+ */
+static void lat_add(lat_hist_t *hist, unsigned long long ns)
+{
+    int msb = 0;
+
+    while ((ns >> msb) > 1)
+	msb++;
+    hist->count++;
+    hist->max = (ns > hist->max) ? ns : hist->max;
+    if (msb < LAT_SUB_BITS)
+	hist->buckets[ns]++;
+    else
+	hist->buckets[((msb - LAT_SUB_BITS + 1) << LAT_SUB_BITS) | 
+		      ((ns >> (msb - LAT_SUB_BITS)) & 
+		       ((1 << LAT_SUB_BITS) - 1))]++;
+}
+
+/*
+ * lat_merge - Adds the requests of histogram src to histogram dst
+ */
+static void lat_merge(lat_hist_t *dst, lat_hist_t *src)
+{
+    int i;
+
+    dst->count += src->count;
+    dst->max = (src->max > dst->max) ? src->max : dst->max;
+    for (i = 0; i < LAT_BUCKETS; i++)
+	dst->buckets[i] += src->buckets[i];
+}
+
+/*
+ * lat_percentile - Returns the latency that fraction q of the requests
+ *    in a histogram did not exceed, rounded up to the end of its bucket
+ */
+static unsigned long long lat_percentile(lat_hist_t *hist, double q)
+{
+    int i, shift;
+    unsigned long seen = 0;
+    unsigned long long rank, hi;
+
+    rank = (unsigned long long)(q * hist->count);
+    rank = (rank < 1) ? 1 : rank;
+    for (i = 0; i < LAT_BUCKETS; i++) {
+	seen += hist->buckets[i];
+	if (seen >= rank)
+	    break;
+    }
+    if (i >= LAT_BUCKETS)
+	return hist->max;
+
+    /* Find the last latency that falls in bucket i */
+    if (i < (1 << LAT_SUB_BITS)) {
+	hi = i;
+    }
+    else {
+	shift = (i >> LAT_SUB_BITS) - 1;
+	hi = ((unsigned long long)((1 << LAT_SUB_BITS) | 
+				   (i & ((1 << LAT_SUB_BITS) - 1))) << shift) + 
+	    (1ULL << shift) - 1;
+    }
+    return (hi < hist->max) ? hi : hist->max;
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -972,6 +1765,159 @@ static void printresults(int n, stats_t *stats)
 
 }
 
+/*
+ * printparresults - prints a summary of the parallel replays, with the
+ *    aggregate throughput of all threads, the throughput of the slowest
+ *    and fastest thread, and how often a heap lock was contended
+ */
+static void printparresults(int n, stats_t *stats, par_stats_t *par_stats)
+{
+    int i;
+    double secs = 0;
+    double ops = 0;
+    double acquired = 0;
+    double contended = 0;
+
+    printf("%5s%10s%10s%10s%10s%10s%8s\n", 
+	   "trace", "ops", "secs", "Kops", "min Kops", "max Kops", "contend");
+    for (i=0; i < n; i++) {
+	if (stats[i].valid && par_stats[i].valid) {
+	    printf("%2d%13.0f%10.6f%10.0f%10.0f%10.0f%7.1f%%\n",
+		   i,
+		   par_stats[i].ops,
+		   par_stats[i].secs,
+		   (par_stats[i].ops/1e3)/par_stats[i].secs,
+		   par_stats[i].min_kops,
+		   par_stats[i].max_kops,
+		   par_stats[i].locks.acquired ? 100.0 * 
+		   par_stats[i].locks.contended / par_stats[i].locks.acquired : 0.0);
+	    secs += par_stats[i].secs;
+	    ops += par_stats[i].ops;
+	    acquired += par_stats[i].locks.acquired;
+	    contended += par_stats[i].locks.contended;
+	}
+	else {
+	    printf("%2d%13s%10s%10s%10s%10s%8s\n", 
+		   i, "-", "-", "-", "-", "-", "-");
+	}
+    }
+
+    /* Print the aggregate results for the set of traces */
+    printf("%5s%10.0f%10.6f%10.0f%20s%7.1f%%\n", 
+	   "Total",
+	   ops, 
+	   secs,
+	   (ops/1e3)/secs,
+	   "",
+	   acquired ? 100.0 * contended / acquired : 0.0);
+}
+
+/*
+ * printlatresults - prints the latency percentiles of each type of
+ *    request, per trace if verbose, and over all of the traces
+ */
+static void printlatresults(int n, stats_t *stats, lat_stats_t *lat_stats)
+{
+    int i, type;
+    lat_stats_t total;
+    static char *names[] = {"malloc", "free", "realloc"};
+
+    memset(&total, 0, sizeof(total));
+    printf("%5s%9s%10s%8s%8s%8s%10s\n", 
+	   "trace", "request", "count", "p50", "p99", "p99.9", "max");
+    for (i=0; i < n; i++) {
+	if (!stats[i].valid)
+	    continue;
+	for (type = ALLOC; type <= REALLOC; type++) {
+	    lat_merge(&total.hists[type], &lat_stats[i].hists[type]);
+	    if (verbose && lat_stats[i].hists[type].count > 0)
+		print_lat_hist(i, names[type], &lat_stats[i].hists[type]);
+	}
+    }
+
+    /* Print the latencies over the set of traces */
+    for (type = ALLOC; type <= REALLOC; type++) {
+	if (total.hists[type].count > 0)
+	    print_lat_hist(-1, names[type], &total.hists[type]);
+    }
+}
+
+/*
+ * printheapresults - prints the heap statistics of the valid traces:
+ *    the size of the heap, its live and free bytes and its largest free
+ *    block at the payload peak, with the external fragmentation
+ *    1 - largest/free, and the counts of heap extensions, splits and
+ *    coalesces over the whole trace. With -V, the free blocks at the
+ *    peak are broken down by power-of-two size class. A second table
+ *    shows the TLB footprint at the peak: the pages and 2 MB frames
+ *    spanned by the heap, and how many of them hold allocated blocks.
+ */
+static void printheapresults(int n, stats_t *stats, heap_stats_t *heap_stats)
+{
+    int i, cls;
+    mm_stats_t *peak, *end;
+
+    printf("%5s%9s%9s%9s%9s%6s%9s%9s%9s\n", 
+	   "trace", "heap", "live", "free", "largest", "frag", 
+	   "extends", "splits", "coalesce");
+    for (i=0; i < n; i++) {
+	if (!stats[i].valid)
+	    continue;
+	peak = &heap_stats[i].peak;
+	end = &heap_stats[i].end;
+	printf("%2d   %9.0f%9.0f%9.0f%9.0f%5.0f%%%9lu%9lu%9lu\n",
+	       i,
+	       (peak->heap_bytes + peak->mapped_bytes) / 1024.0,
+	       (peak->live_bytes + peak->mapped_bytes) / 1024.0,
+	       peak->free_bytes / 1024.0,
+	       peak->largest_free / 1024.0,
+	       peak->fragmentation * 100.0,
+	       end->extends,
+	       end->splits,
+	       end->coalesces);
+	if (verbose < 2)
+	    continue;
+	for (cls = 0; cls < MM_STATS_CLASSES; cls++) {
+	    if (peak->free_blocks[cls] > 0)
+		printf("%14s%lu-%lu: %lu blocks, %.1f KB\n", "free ",
+		       1UL << cls, (2UL << cls) - 1,
+		       (unsigned long)peak->free_blocks[cls],
+		       peak->free_class_bytes[cls] / 1024.0);
+	}
+    }
+
+    printf("%5s%9s%9s%9s%9s\n", "trace", "pages", "live", "2M", "live");
+    for (i=0; i < n; i++) {
+	if (!stats[i].valid)
+	    continue;
+	printf("%2d   %9lu%9lu%9lu%9lu\n",
+	       i,
+	       (unsigned long)heap_stats[i].footprint.pages,
+	       (unsigned long)heap_stats[i].footprint.live_pages,
+	       (unsigned long)heap_stats[i].footprint.huge_pages,
+	       (unsigned long)heap_stats[i].footprint.live_huge_pages);
+    }
+}
+
+/*
+ * print_lat_hist - prints one row of the latency table, for trace
+ *    tracenum or for the total if tracenum is negative
+ */
+static void print_lat_hist(int tracenum, char *name, lat_hist_t *hist)
+{
+    if (tracenum < 0)
+	printf("%5s", "Total");
+    else
+	printf("%2d   ", tracenum);
+    printf("%9s%10lu%8llu%8llu%8llu%10llu\n",
+	   name,
+	   hist->count,
+	   lat_percentile(hist, 0.50),
+	   lat_percentile(hist, 0.99),
+	   lat_percentile(hist, 0.999),
+	   hist->max);
+}
+
 /* 
  * app_error - Report an arbitrary application error
  */
@@ -991,12 +1937,65 @@ void unix_error(char *msg)
 }
 
 /*
- * malloc_error - Report an error returned by the mm_malloc package
+ * malloc_error - Report an error returned by the mm_malloc package,
+ *     in request opnum of trace tracenum, or of eval_mm_api if it is -1
  */
 void malloc_error(int tracenum, int opnum, char *msg)
 {
     errors++;
-    printf("ERROR [trace %d, line %d]: %s\n", tracenum, LINENUM(opnum), msg);
+    if (tracenum < 0)
+	printf("ERROR [eval_mm_api, request %d]: %s\n", opnum, msg);
+    else
+	printf("ERROR [trace %d, line %d]: %s\n", tracenum, LINENUM(opnum), msg);
+}
+
+/*
+ * parse_backend - Parse the memlib backend of -b, a comma-separated list
+ *     of real (commit heap pages as the brk grows and decommit them when
+ *     the heap is reset), populate (real, prefaulting the committed pages)
+ *     and huge (real, with transparent huge pages). Returns -1 if the
+ *     list is malformed.
+ */
+static int parse_backend(char *arg)
+{
+    int backend = MEM_SIMULATED;
+    char *name;
+
+    for (name = strtok(arg, ","); name != NULL; name = strtok(NULL, ",")) {
+	if (!strcmp(name, "real"))
+	    backend |= MEM_REAL;
+	else if (!strcmp(name, "populate"))
+	    backend |= MEM_REAL | MEM_POPULATE;
+	else if (!strcmp(name, "huge"))
+	    backend |= MEM_REAL | MEM_HUGE;
+	else
+	    return -1;
+    }
+    return backend;
+}
+
+/*
+ * parse_variants - Parse the variants of -m, a comma-separated list of
+ *     names from mm_variants, or all. Sets selected[v] for the listed
+ *     variants only. Returns -1 if a name is unknown.
+ */
+static int parse_variants(char *arg, int *selected)
+{
+    char *name;
+    int v, found;
+
+    for (v = 0; v < mm_num_variants; v++)
+	selected[v] = 0;
+    for (name = strtok(arg, ","); name != NULL; name = strtok(NULL, ",")) {
+	found = 0;
+	for (v = 0; v < mm_num_variants; v++) {
+	    if (!strcmp(name, "all") || !strcmp(name, mm_variants[v].name))
+		selected[v] = found = 1;
+	}
+	if (!found)
+	    return -1;
+    }
+    return 0;
 }
 
 /* 
@@ -1004,13 +2003,19 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvVaLlr] [-f <file>] [-t <dir>] [-p <n>] [-b <backend>] [-m <list>] [-P <file>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
+    fprintf(stderr, "\t-b <list>  Back the heap by real memory: real, populate, huge.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-m <list>  Evaluate only these variants of mm (mdriver-variants).\n");
+    fprintf(stderr, "\t-L         Also measure the latency of each request.\n");
+    fprintf(stderr, "\t-p <n>     Also replay shards of each trace on <n> threads.\n");
+    fprintf(stderr, "\t-P <file>  Write the allocation profile of each trace (MM_PROFILE).\n");
+    fprintf(stderr, "\t-r         With -p, every thread replays the whole trace.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
@@ -2,7 +2,35 @@
  * memlib.c - a module that simulates the memory system.  Needed because it 
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
+ *
+ *            The simulated memory is split into regions of MAX_HEAP bytes
+ *            each, one by default and up to MEM_NUM_ARENAS with
+ *            mem_set_arenas, and every region has its own brk pointer.
+ *            The classic interface (mem_sbrk, mem_heap_lo, ...) operates on
+ *            the first region, while the mem_arena_* functions let a
+ *            multi-arena allocator grow each region independently.
+ *
+ *            The regions are reserved with one anonymous mmap, so that pages
+ *            given back by a shrinking brk or by mem_release are really
+ *            returned to the system. The part of a region that has never
+ *            been below its brk still reads as zeros, which mem_arena_fresh
+ *            reports so that calloc can skip clearing it.
+ *
+ *            By default the pages of a region stay backed once the brk
+ *            has grown over them, even across mem_reset_brk, so that
+ *            repeated runs do not pay for page faults. The real backend
+ *            (mem_set_backend) behaves like the system heap instead: the
+ *            regions are reserved without access, mem_sbrk commits the
+ *            pages it grows over, optionally prefaulting them or backing
+ *            them with transparent huge pages, and lowering or resetting
+ *            the brk decommits them again.
+ *
+ *            Besides the brk regions, mem_map hands out separate mappings
+ *            for huge blocks. They count towards the heap size until they
+ *            are unmapped or the brk is reset. Like the brk functions, the
+ *            mapping functions must not be called concurrently.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -10,28 +38,114 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
 
 #include "memlib.h"
 #include "config.h"
 
+/* size of a transparent huge page on x86-64 */
+#define MEM_HUGE_PAGE (2 * (1 << 20))
+
+/* all arenas and the huge page alignment must fit in the address space */
+#if MAX_HEAP > (SIZE_MAX - MEM_HUGE_PAGE) / MEM_NUM_ARENAS
+#error "MAX_HEAP is too large for MEM_NUM_ARENAS arenas, use a 64-bit build"
+#endif
+
 /* private variables */
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
 
+/* number of arenas reserved by mem_init */
+static int mem_arenas = 1;
+
+/* per-arena brk pointers; arena 0 is the classic heap above */
+static char *mem_arena_brk[MEM_NUM_ARENAS];
+
+/* highest brk of each arena since mem_init, above which memory is zeros */
+static char *mem_arena_top[MEM_NUM_ARENAS];
+
+/* the real backend commits the pages of each arena up to here */
+static int mem_backend = MEM_SIMULATED;
+static char *mem_arena_commit[MEM_NUM_ARENAS];
+static char *mem_reserved;   /* start of the reserved address space */
+static size_t mem_reserved_len;
+
+static size_t mem_peak;      /* largest total heap size since the last reset */
+
+/* live mappings handed out by mem_map */
+static struct {
+    char *addr;
+    size_t len;
+} mem_maps[MEM_MAX_MAPPINGS];
+static int mem_num_maps;
+static size_t mem_map_bytes; /* total length of the live mappings */
+
+static void mem_update_peak(void);
+static void mem_update_top(int arena, char *brk);
+static void mem_release_above(int arena, char *brk, char *old_brk);
+static int mem_commit(int arena, char *brk);
+static void mem_decommit(int arena, char *brk);
+static int mem_find_map(void *addr);
+static void mem_unmap_all(void);
+
+/*
+ * mem_set_backend - select the backend of the memory system, a
+ *    combination of the MEM_* flags in memlib.h. Must be called before
+ *    mem_init.
+ */
+void mem_set_backend(int backend)
+{
+    if (backend & (MEM_POPULATE | MEM_HUGE))
+	backend |= MEM_REAL;
+    mem_backend = backend;
+}
+
+/*
+ * mem_set_arenas - select the number of arenas, at most MEM_NUM_ARENAS,
+ *    for which mem_init reserves address space. Must be called before
+ *    mem_init.
+ */
+void mem_set_arenas(int arenas)
+{
+    assert(arenas >= 1 && arenas <= MEM_NUM_ARENAS);
+    mem_arenas = arenas;
+}
+
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-	fprintf(stderr, "mem_init_vm: malloc error\n");
+    int i;
+
+    /* 
+     * reserve the address space we will use to model the available VM,
+     * aligned to huge pages so that every arena can use them
+     */
+    mem_reserved_len = (size_t)mem_arenas * MAX_HEAP;
+    if (mem_backend & MEM_HUGE)
+	mem_reserved_len += MEM_HUGE_PAGE;
+    mem_reserved = (char *)mmap(NULL, mem_reserved_len,
+				(mem_backend & MEM_REAL) ? PROT_NONE :
+				PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+				-1, 0);
+    if (mem_reserved == MAP_FAILED) {
+	fprintf(stderr, "mem_init_vm: mmap error\n");
 	exit(1);
     }
+    mem_start_brk = mem_reserved;
+    if (mem_backend & MEM_HUGE)
+	mem_start_brk = (char *)(((size_t)mem_reserved + MEM_HUGE_PAGE - 1) &
+				 ~(MEM_HUGE_PAGE - 1));
 
     mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
     mem_brk = mem_start_brk;                  /* heap is empty initially */
+    for (i = 1; i < mem_arenas; i++)
+	mem_arena_brk[i] = (char *)mem_arena_lo(i);
+    for (i = 0; i < mem_arenas; i++)
+	mem_arena_top[i] = mem_arena_commit[i] = (char *)mem_arena_lo(i);
 }
 
 /* 
@@ -39,32 +153,51 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    mem_unmap_all();
+    munmap(mem_reserved, mem_reserved_len);
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointers to make empty heaps,
+ *    and unmap all mappings. The real backend also decommits the pages of
+ *    the heaps, so that the next run starts out like a new process.
  */
 void mem_reset_brk()
 {
+    int i;
+
+    mem_unmap_all();
     mem_brk = mem_start_brk;
+    for (i = 1; i < mem_arenas; i++)
+	mem_arena_brk[i] = (char *)mem_arena_lo(i);
+    for (i = 0; i < mem_arenas; i++)
+	mem_decommit(i, (char *)mem_arena_lo(i));
+    mem_peak = 0;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area. A
+ *    negative incr shrinks the heap and releases the pages above the
+ *    new brk.
  */
 void *mem_sbrk(int incr) 
 {
     char *old_brk = mem_brk;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    if ((mem_brk + incr < mem_start_brk) || ((mem_brk + incr) > mem_max_addr) ||
+	mem_commit(0, mem_brk + incr) < 0) {
 	errno = ENOMEM;
 	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 	return (void *)-1;
     }
     mem_brk += incr;
+    if (incr < 0)
+	mem_release_above(0, mem_brk, old_brk);
+    else {
+	mem_update_peak();
+	mem_update_top(0, mem_brk);
+    }
     return (void *)old_brk;
 }
 
@@ -77,19 +210,57 @@ void *mem_heap_lo()
 }
 
 /* 
- * mem_heap_hi - return address of last heap byte
+ * mem_heap_hi - return address of last heap byte, which lies in the
+ *    highest arena that has been extended
  */
 void *mem_heap_hi()
 {
+    int i;
+
+    for (i = mem_arenas - 1; i > 0; i--) {
+	if (mem_arena_brk[i] != mem_arena_lo(i))
+	    return (void *)(mem_arena_brk[i] - 1);
+    }
     return (void *)(mem_brk - 1);
 }
 
 /*
- * mem_heapsize() - returns the heap size in bytes
+ * mem_heapsize() - returns the heap size in bytes, summed over all arenas
+ *    and mappings
  */
 size_t mem_heapsize() 
 {
-    return (size_t)(mem_brk - mem_start_brk);
+    size_t size = (size_t)(mem_brk - mem_start_brk) + mem_map_bytes;
+    int i;
+
+    for (i = 1; i < mem_arenas; i++)
+	size += (size_t)(mem_arena_brk[i] - (char *)mem_arena_lo(i));
+    return size;
+}
+
+/*
+ * mem_peak_heapsize() - returns the largest total heap size in bytes
+ *    since the last mem_reset_brk. Unlike mem_heapsize, it is not
+ *    lowered when the heap shrinks.
+ */
+size_t mem_peak_heapsize()
+{
+    return mem_peak;
+}
+
+/*
+ * mem_release - give the whole pages inside [addr, addr + len) back to
+ *    the system, like madvise(MADV_DONTNEED). The range stays part of the
+ *    heap, and the released pages read as zeros when touched again.
+ */
+void mem_release(void *addr, size_t len)
+{
+    size_t pagesize = mem_pagesize();
+    char *lo = (char *)(((size_t)addr + pagesize - 1) & ~(pagesize - 1));
+    char *hi = (char *)(((size_t)addr + len) & ~(pagesize - 1));
+
+    if (lo < hi)
+	madvise(lo, hi - lo, MADV_DONTNEED);
 }
 
 /*
@@ -99,3 +270,280 @@ size_t mem_pagesize()
 {
     return (size_t)getpagesize();
 }
+
+/*
+ * mem_in_heap - returns true if [lo, hi] lies below the brk of the
+ *    region containing lo or within a single live mapping
+ */
+int mem_in_heap(void *lo, void *hi)
+{
+    char *clo = (char *)lo, *chi = (char *)hi;
+    int i = mem_arena_of(lo);
+
+    if (i >= 0)
+	return chi <= (char *)mem_arena_hi(i);
+    for (i = 0; i < mem_num_maps; i++) {
+	if (clo >= mem_maps[i].addr && chi < mem_maps[i].addr + mem_maps[i].len)
+	    return 1;
+    }
+    return 0;
+}
+
+/*
+ * mem_map - map len bytes of fresh zeroed memory outside the brk regions.
+ *    Returns (void *)-1 on failure.
+ */
+void *mem_map(size_t len)
+{
+    char *addr;
+
+    if (mem_num_maps == MEM_MAX_MAPPINGS) {
+	errno = ENOMEM;
+	return (void *)-1;
+    }
+    addr = (char *)mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS |
+			((mem_backend & MEM_POPULATE) ? MAP_POPULATE : 0),
+			-1, 0);
+    if (addr == MAP_FAILED)
+	return (void *)-1;
+    mem_maps[mem_num_maps].addr = addr;
+    mem_maps[mem_num_maps].len = len;
+    mem_num_maps++;
+    mem_map_bytes += len;
+    mem_update_peak();
+    return (void *)addr;
+}
+
+/*
+ * mem_remap - resize a mapping returned by mem_map, moving it if it cannot
+ *    grow in place. Returns the new address, or (void *)-1 on failure, in
+ *    which case the old mapping is left untouched.
+ */
+void *mem_remap(void *addr, size_t old_len, size_t new_len)
+{
+    int i = mem_find_map(addr);
+    char *new_addr;
+
+    assert(i >= 0 && mem_maps[i].len == old_len);
+    new_addr = (char *)mremap(addr, old_len, new_len, MREMAP_MAYMOVE);
+    if (new_addr == MAP_FAILED)
+	return (void *)-1;
+    mem_maps[i].addr = new_addr;
+    mem_maps[i].len = new_len;
+    mem_map_bytes = mem_map_bytes - old_len + new_len;
+    mem_update_peak();
+    return (void *)new_addr;
+}
+
+/*
+ * mem_unmap - unmap a mapping returned by mem_map
+ */
+void mem_unmap(void *addr, size_t len)
+{
+    int i = mem_find_map(addr);
+
+    assert(i >= 0 && mem_maps[i].len == len);
+    munmap(addr, len);
+    mem_map_bytes -= len;
+    mem_maps[i] = mem_maps[--mem_num_maps];
+}
+
+/*
+ * mem_num_arenas - returns the number of independent heap regions
+ */
+int mem_num_arenas()
+{
+    return mem_arenas;
+}
+
+/*
+ * mem_arena_of - returns the arena whose region contains p, or -1
+ */
+int mem_arena_of(void *p)
+{
+    char *cp = (char *)p;
+
+    if (cp < mem_start_brk || cp >= mem_start_brk + 
+	(size_t)mem_arenas * MAX_HEAP)
+	return -1;
+    return (int)((size_t)(cp - mem_start_brk) / MAX_HEAP);
+}
+
+/*
+ * mem_arena_sbrk - mem_sbrk on the region of the given arena
+ */
+void *mem_arena_sbrk(int arena, int incr)
+{
+    char *old_brk;
+
+    assert(arena >= 0 && arena < mem_arenas);
+    if (arena == 0)
+	return mem_sbrk(incr);
+
+    old_brk = mem_arena_brk[arena];
+    if ((old_brk + incr < (char *)mem_arena_lo(arena)) || 
+	((old_brk + incr) > (char *)mem_arena_lo(arena) + MAX_HEAP) ||
+	mem_commit(arena, old_brk + incr) < 0) {
+	errno = ENOMEM;
+	fprintf(stderr, "ERROR: mem_arena_sbrk failed. Ran out of memory...\n");
+	return (void *)-1;
+    }
+    mem_arena_brk[arena] += incr;
+    if (incr < 0)
+	mem_release_above(arena, mem_arena_brk[arena], old_brk);
+    else {
+	mem_update_peak();
+	mem_update_top(arena, mem_arena_brk[arena]);
+    }
+    return (void *)old_brk;
+}
+
+/*
+ * mem_arena_fresh - return the lowest address of an arena that has never
+ *    been below its brk. Memory from there on reads as zeros. Neither
+ *    resetting nor lowering the brk lowers it, since memory that was once
+ *    below the brk may still hold data, unless the real backend decommits
+ *    that memory.
+ */
+void *mem_arena_fresh(int arena)
+{
+    assert(arena >= 0 && arena < mem_arenas);
+    return (void *)mem_arena_top[arena];
+}
+
+/*
+ * mem_arena_lo - return address of the first byte of an arena
+ */
+void *mem_arena_lo(int arena)
+{
+    return (void *)(mem_start_brk + (size_t)arena * MAX_HEAP);
+}
+
+/*
+ * mem_arena_hi - return address of the last byte of an arena
+ */
+void *mem_arena_hi(int arena)
+{
+    if (arena == 0)
+	return (void *)(mem_brk - 1);
+    return (void *)(mem_arena_brk[arena] - 1);
+}
+
+/*
+ * mem_update_peak - record the current total heap size if it is the
+ *    largest so far
+ */
+static void mem_update_peak(void)
+{
+    size_t size = mem_heapsize();
+
+    if (size > mem_peak)
+	mem_peak = size;
+}
+
+/*
+ * mem_update_top - record a raised brk of an arena if it is the highest
+ *    so far
+ */
+static void mem_update_top(int arena, char *brk)
+{
+    if (brk > mem_arena_top[arena])
+	mem_arena_top[arena] = brk;
+}
+
+/*
+ * mem_release_above - release the pages between a lowered brk and the
+ *    old one
+ */
+static void mem_release_above(int arena, char *brk, char *old_brk)
+{
+    if (mem_backend & MEM_REAL)
+	mem_decommit(arena, brk);
+    else
+	mem_release(brk, (size_t)(old_brk - brk));
+}
+
+/*
+ * mem_granule - the unit in which the real backend commits memory
+ */
+static size_t mem_granule(void)
+{
+    return (mem_backend & MEM_HUGE) ? MEM_HUGE_PAGE : mem_pagesize();
+}
+
+/*
+ * mem_commit - with the real backend, make the pages of an arena up to
+ *    brk accessible. Returns -1 if the system is out of memory.
+ */
+static int mem_commit(int arena, char *brk)
+{
+    size_t granule = mem_granule();
+    char *lo = mem_arena_commit[arena];
+    char *hi = (char *)(((size_t)brk + granule - 1) & ~(granule - 1));
+    char *p;
+
+    if (!(mem_backend & MEM_REAL) || hi <= lo)
+	return 0;
+    if (hi > (char *)mem_arena_lo(arena) + MAX_HEAP)
+	hi = (char *)mem_arena_lo(arena) + MAX_HEAP;
+    /* huge pages must be requested before the pages are faulted in */
+    if (mmap(lo, hi - lo, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED |
+	     ((mem_backend & (MEM_POPULATE | MEM_HUGE)) == MEM_POPULATE ?
+	      MAP_POPULATE : 0), -1, 0) == MAP_FAILED)
+	return -1;
+    if (mem_backend & MEM_HUGE) {
+	madvise(lo, hi - lo, MADV_HUGEPAGE);
+	if (mem_backend & MEM_POPULATE) {
+	    for (p = lo; p < hi; p += mem_pagesize())
+		*(volatile char *)p = 0;
+	}
+    }
+    mem_arena_commit[arena] = hi;
+    return 0;
+}
+
+/*
+ * mem_decommit - with the real backend, give the pages of an arena above
+ *    brk back to the system and make them inaccessible again. The memory
+ *    above the first granule boundary at or above brk reads as zeros
+ *    afterwards.
+ */
+static void mem_decommit(int arena, char *brk)
+{
+    size_t granule = mem_granule();
+    char *lo = (char *)(((size_t)brk + granule - 1) & ~(granule - 1));
+    char *hi = mem_arena_commit[arena];
+
+    if (!(mem_backend & MEM_REAL) || hi <= lo)
+	return;
+    mmap(lo, hi - lo, PROT_NONE,
+	 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+    mem_arena_commit[arena] = lo;
+    if (mem_arena_top[arena] > lo)
+	mem_arena_top[arena] = lo;
+}
+
+/*
+ * mem_find_map - returns the index of the mapping starting at addr, or -1
+ */
+static int mem_find_map(void *addr)
+{
+    int i;
+
+    for (i = 0; i < mem_num_maps; i++) {
+	if (mem_maps[i].addr == (char *)addr)
+	    return i;
+    }
+    return -1;
+}
+
+/*
+ * mem_unmap_all - unmap all live mappings
+ */
+static void mem_unmap_all(void)
+{
+    while (mem_num_maps > 0)
+	mem_unmap(mem_maps[0].addr, mem_maps[0].len);
+}
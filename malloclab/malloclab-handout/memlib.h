@@ -1,5 +1,17 @@
 #include <unistd.h>
 
+/*
+ * Backends of the memory system, for mem_set_backend. MEM_POPULATE and
+ * MEM_HUGE imply MEM_REAL.
+ */
+#define MEM_SIMULATED 0x0 /* pages stay backed once the brk grew over them */
+#define MEM_REAL      0x1 /* mem_sbrk commits pages, lowering it decommits */
+#define MEM_POPULATE  0x2 /* prefault pages as they are committed */
+#define MEM_HUGE      0x4 /* back the heaps with transparent huge pages */
+
+void mem_set_backend(int backend);
+void mem_set_arenas(int arenas);
+
 void mem_init(void);               
 void mem_deinit(void);
 void *mem_sbrk(int incr);
@@ -7,5 +19,19 @@ void mem_reset_brk(void);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_peak_heapsize(void);
+void mem_release(void *addr, size_t len);
 size_t mem_pagesize(void);
+int mem_in_heap(void *lo, void *hi);
+
+void *mem_map(size_t len);
+void *mem_remap(void *addr, size_t old_len, size_t new_len);
+void mem_unmap(void *addr, size_t len);
+
+int mem_num_arenas(void);
+int mem_arena_of(void *p);
+void *mem_arena_sbrk(int arena, int incr);
+void *mem_arena_lo(int arena);
+void *mem_arena_hi(int arena);
+void *mem_arena_fresh(int arena);
 
@@ -9,6 +9,8 @@
  * blocks, by storing a prev and next pointer in each free block.
  * - MM_SEGREGATED: maintains multiple free lists where each list holds blocks
  * that are roughly the same size.
+ * - MM_TREE: keeps all free blocks in a splay tree ordered by size and then by
+ * address, so that the best fit is found in logarithmic amortized time.
  *
  * The placement strategy could be first-fit or best-fit, enabled by the macros
  * below.
@@ -16,35 +18,99 @@
  * first free block that fits.
  * - MM_BEST_FIT: examines every free block and chooses the free block with the
  * smallest size that fits.
+ * - MM_ADDRESS_ORDERED: may be combined with MM_EXPLICIT or MM_SEGREGATED.
+ * Each free list is kept in address order instead of LIFO order, so that
+ * first fit prefers the lowest addresses.
+ * - MM_DEFERRED_COALESCING: may be combined with either of the above. Freed
+ * small blocks are parked in quick lists of exactly sized blocks and reused
+ * as is, and are only coalesced in a batch when an allocation misses or too
+ * many bytes are parked.
  *
- * Splitting and coalescing are performed as long as possible.
+ * Splitting and coalescing are performed as long as possible, unless
+ * coalescing is deferred.
  * - After placing a newly allocated block in a free block, the free block is
  * split into an allocated block and a free block, if the remainder is large
  * enough for a new block.
  * - After freeing an allocated block, adjacent free blocks always coalesce into
  * a single larger free block.
  *
+ * The allocator is single-threaded unless one of the macros below is defined.
+ * - MM_THREAD_SAFE: serializes every heap operation with a global lock.
+ * - MM_TCACHE: implies MM_THREAD_SAFE, and puts per-thread caches of small
+ * blocks in front of the locked heap, so that most malloc and free requests
+ * never touch the lock. Requires MM_SEGREGATED.
+ * - MM_ARENAS=n: implies MM_THREAD_SAFE, and splits the heap into n
+ * independent arenas with their own locks, each grown in a separate memlib
+ * region. Threads are assigned to arenas round-robin, or by the CPU they run on
+ * if MM_ARENA_PERCPU is also defined. Blocks are always freed into the arena
+ * whose region contains them.
+ * - MM_REMOTE_FREE: requires MM_ARENAS. A thread freeing a block of another
+ * arena whose lock is held pushes it onto a lock-free queue of that arena
+ * instead of waiting for the lock, and the next request that locks the arena
+ * frees the queued blocks.
+ *
+ * With MM_TRIM, memory goes back to the system after a burst: a free block of
+ * at least MM_TRIM_THRESHOLD bytes at the end of the heap is trimmed off by
+ * lowering the brk, and the whole pages inside any other free block of at
+ * least MM_RELEASE_THRESHOLD bytes are released with mem_release.
+ *
+ * With MM_CHUNK_SIZE=n, a power of two, the heap grows up to the next
+ * multiple of n bytes, and the surplus stays free at the end of the heap. With
+ * n = 2 MB, the heap grows in whole transparent huge pages, so that fewer TLB
+ * entries cover it. MM_TRIM then only trims whole chunks off the heap.
+ *
+ * With MM_MMAP, requests of at least MM_MMAP_THRESHOLD bytes bypass the heap
+ * and are served by a memlib mapping of their own, which is unmapped when the
+ * block is freed and resized with mem_remap when it is reallocated.
+ *
+ * With MM_SLAB, requests of at most SLAB_MAX_SIZE bytes are served from slabs
+ * of equally sized objects without any per-object header.
+ *
+ * Payloads are aligned to MM_ALIGNMENT bytes, 8 by default. It may be set to
+ * 16 to match the alignment the C library guarantees on 64-bit systems.
+ *
+ * mm_calloc only clears the part of a payload that may hold old data. Each
+ * heap keeps track of how far its blocks reach into memory that memlib handed
+ * out fresh, which still reads as zeros, and mapped chunks are always fresh.
+ *
+ * With MM_CHECK, the whole heap is checked after every request. With
+ * MM_CHECK_INCREMENTAL, only the blocks changed by the request are checked,
+ * along with their neighbors and free list links, plus a window of
+ * MM_CHECK_WINDOW blocks that moves through the heap and the free lists with
+ * every request, so that checking stays cheap on large heaps.
+ *
+ * With MM_PROFILE, each heap counts the requests it serves per free list class
+ * and per power-of-two bucket of request sizes: allocations, frees, how many
+ * allocations found a free block and how many grew the heap, splits, and a
+ * histogram of how many blocks find_fit looked at. mm_profile_dump writes the
+ * counters as CSV.
+ *
  * The block format is shown below. An allocated block contains a header
- * followed by the user payload. The header is a size_t (32-bit) integer. The
- * first 29 bits encode the entire block size in double words. The P bit is 1
- * only if the previous block is allocated. The A bit is 1 only if this block is
- * allocated. Allocated blocks need no footer since they do not coalesce. A free
- * block contains both header and footer sections. The footer is always
- * identical to the header, providing block size information for the next block
- * when it needs to coalesce this block. When using explicit or segregated free
- * lists, each free block is also a node of an external doubly linked free list.
- * The previous and next pointers are stored in the payload section of each free
- * block.
+ * followed by the user payload. The header is a word, which is a size_t
+ * integer, or a 32-bit integer with MM_COMPACT. All but the last 3 bits encode
+ * the entire block size in double words. The P bit is 1 only if the previous
+ * block is allocated. The A bit is 1 only if this block is allocated. The R bit
+ * is 1 only if this allocated block has been grown by realloc, which then
+ * over-allocates it when it has to move again. Allocated blocks need no footer
+ * since they do not coalesce. A free block contains both header and footer
+ * sections. The footer is always identical to the header, providing block size
+ * information for the next block when it needs to coalesce this block. When
+ * using explicit or segregated free lists, each free block is also a node of an
+ * external doubly linked free list. The previous and next links are stored in
+ * the payload section of each free block. They are pointers, or 32-bit offsets
+ * with MM_COMPACT, so that on 64-bit builds the compact format shrinks the
+ * minimum block from 32 to 16 bytes.
  */
 /* clang-format off */
 /*
  *  31                                0            31                                0
  * +-----------------------------+-+-+-+          +-----------------------------+-+-+-+
- * |           Block Size        | |P|A|  Header  |           Block Size        | |P|A| P: Previous Allocated
+ * |           Block Size        |R|P|A|  Header  |           Block Size        | |P|A| P: Previous Allocated
  * +-----------------------------+-+-+-+ <- bp -> +-----------------------------+-+-+-+ A: Allocated
- * |                                   |          |    Prev Pointer (expl/segr only)  |
+ *                                                                                      R: Realloc Grown
+ * |                                   |          |     Prev Link (expl/segr only)    |
  * |                                   |          +-----------------------------------+
- * |             Payload               |          |    Next Pointer (expl/segr only)  |
+ * |             Payload               |          |     Next Link (expl/segr only)    |
  * |                                   |          +-----------------------------------+
  * |                                   |          |             Padding               |
  * |                                   |          +-----------------------------+-+-+-+
@@ -54,16 +120,43 @@
  */
 /* clang-format on */
 
+#define _GNU_SOURCE
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+/*
+ * With MM_VARIANT=name, this file is built as one of the variants that
+ * mdriver-variants evaluates side by side (see mmvariants.c), and its entry
+ * points are named mm_name_malloc and so on instead of mm_malloc.
+ */
+#ifdef MM_VARIANT
+#define MM_CAT3(a, b, c) a##b##c
+#define MM_NAME(a, b, c) MM_CAT3(a, b, c)
+#define mm_init MM_NAME(mm_, MM_VARIANT, _init)
+#define mm_malloc MM_NAME(mm_, MM_VARIANT, _malloc)
+#define mm_calloc MM_NAME(mm_, MM_VARIANT, _calloc)
+#define mm_free MM_NAME(mm_, MM_VARIANT, _free)
+#define mm_realloc MM_NAME(mm_, MM_VARIANT, _realloc)
+#define mm_memalign MM_NAME(mm_, MM_VARIANT, _memalign)
+#define mm_aligned_alloc MM_NAME(mm_, MM_VARIANT, _aligned_alloc)
+#define mm_usable_size MM_NAME(mm_, MM_VARIANT, _usable_size)
+#define mm_stats MM_NAME(mm_, MM_VARIANT, _stats)
+#define mm_footprint MM_NAME(mm_, MM_VARIANT, _footprint)
+#define mm_lock_stats MM_NAME(mm_, MM_VARIANT, _lock_stats)
+#define mm_profile_dump MM_NAME(mm_, MM_VARIANT, _profile_dump)
+#endif
+
 #include "memlib.h"
 #include "mm.h"
 
+#ifndef MM_VARIANT
 /*********************************************************
  * NOTE TO STUDENTS: Before you do anything else, please
  * provide your team information in the following struct.
@@ -79,9 +172,11 @@ team_t team = {
     "",
     /* Second member's email address (leave blank if none) */
     ""};
+#endif
 
 /* Using segregated free list algorithm by default */
-#if !defined(MM_IMPLICIT) && !defined(MM_EXPLICIT) && !defined(MM_SEGREGATED)
+#if !defined(MM_IMPLICIT) && !defined(MM_EXPLICIT) &&                          \
+    !defined(MM_SEGREGATED) && !defined(MM_TREE)
 #define MM_SEGREGATED
 #endif
 
@@ -90,42 +185,109 @@ team_t team = {
 #define MM_BEST_FIT
 #endif
 
+#if defined(MM_TCACHE)
+#if !defined(MM_SEGREGATED)
+#error "MM_TCACHE requires MM_SEGREGATED"
+#endif
+#ifndef MM_THREAD_SAFE
+#define MM_THREAD_SAFE
+#endif
+#endif
+
+#if defined(MM_ADDRESS_ORDERED) && !defined(MM_EXPLICIT) &&                  \
+    !defined(MM_SEGREGATED)
+#error "MM_ADDRESS_ORDERED requires MM_EXPLICIT or MM_SEGREGATED"
+#endif
+
+#if defined(MM_ARENA_PERCPU) && !defined(MM_ARENAS)
+#error "MM_ARENA_PERCPU requires MM_ARENAS"
+#endif
+#if defined(MM_ARENAS) && !defined(MM_THREAD_SAFE)
+#define MM_THREAD_SAFE
+#endif
+#if defined(MM_REMOTE_FREE) && !defined(MM_ARENAS)
+#error "MM_REMOTE_FREE requires MM_ARENAS"
+#endif
+
+#ifndef MM_ALIGNMENT
+#define MM_ALIGNMENT 8
+#endif
+#if MM_ALIGNMENT != 8 && MM_ALIGNMENT != 16
+#error "MM_ALIGNMENT must be 8 or 16"
+#endif
+
+#ifdef MM_CHECK_INCREMENTAL
+#ifndef MM_CHECK
+#define MM_CHECK
+#endif
+#ifndef MM_CHECK_WINDOW
+#define MM_CHECK_WINDOW 16
+#endif
+#endif
+
+#if defined(MM_CHUNK_SIZE) && (MM_CHUNK_SIZE & (MM_CHUNK_SIZE - 1))
+#error "MM_CHUNK_SIZE must be a power of two"
+#endif
+
+#if defined(MM_MMAP) && !defined(MM_MMAP_THRESHOLD)
+#define MM_MMAP_THRESHOLD (128 * 1024)
+#endif
+
+#ifdef MM_TRIM
+#ifndef MM_TRIM_THRESHOLD
+#define MM_TRIM_THRESHOLD (128 * 1024)
+#endif
+#ifndef MM_RELEASE_THRESHOLD
+#define MM_RELEASE_THRESHOLD (256 * 1024)
+#endif
+#endif
+
 /* Common utils */
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 #define MAX(a, b) (((a) > (b)) ? (a) : (b))
 
-static void *block_head;
-static void *block_tail;
+/* Headers and footers are words, which are 4 bytes in the compact format */
+#ifdef MM_COMPACT
+typedef uint32_t word_t;
+#else
+typedef size_t word_t;
+#endif
+#define WSIZE sizeof(word_t)
 
-static const size_t ALIGNMENT = 8;
-static inline size_t align(size_t size) {
-    return (size + (ALIGNMENT - 1)) & ~(ALIGNMENT - 1);
-}
+static const size_t ALIGNMENT = MM_ALIGNMENT;
+// a constant expression, for the minimum block sizes
+#define ALIGN(size)                                                            \
+    (((size) + (MM_ALIGNMENT - 1)) & ~(size_t)(MM_ALIGNMENT - 1))
+static inline size_t align(size_t size) { return ALIGN(size); }
 static inline void set_meta(void *p, size_t size, size_t prev_alloc,
                             size_t alloc) {
-    *(size_t *)p = size | (prev_alloc << 1) | alloc;
+    *(word_t *)p = size | (prev_alloc << 1) | alloc;
 }
 static inline void set_size(void *p, size_t size) {
-    *(size_t *)p = (*(size_t *)p & 0x7) | size;
+    *(word_t *)p = (*(word_t *)p & 0x7) | size;
 }
 static inline void set_prev_alloc(void *p, size_t prev_alloc) {
-    *(size_t *)p = (*(size_t *)p & ~0x2) | (prev_alloc << 1);
+    *(word_t *)p = (*(word_t *)p & ~0x2) | (prev_alloc << 1);
 }
 static inline void set_alloc(void *p, size_t alloc) {
-    *(size_t *)p = (*(size_t *)p & ~0x1) | alloc;
+    *(word_t *)p = (*(word_t *)p & ~0x1) | alloc;
 }
-static inline size_t get_size(void *p) { return *(size_t *)p & ~0x7; }
+static inline void set_grown(void *p, size_t grown) {
+    *(word_t *)p = (*(word_t *)p & ~0x4) | (grown << 2);
+}
+static inline size_t get_size(void *p) { return *(word_t *)p & ~0x7; }
 static inline size_t get_prev_alloc(void *p) {
-    return (*(size_t *)p >> 1) & 0x1;
+    return (*(word_t *)p >> 1) & 0x1;
 }
-static inline size_t get_alloc(void *p) { return *(size_t *)p & 0x1; }
+static inline size_t get_alloc(void *p) { return *(word_t *)p & 0x1; }
+static inline size_t get_grown(void *p) { return (*(word_t *)p >> 2) & 0x1; }
 
-static inline void *header_ptr(void *bp) { return (char *)bp - sizeof(size_t); }
+static inline void *header_ptr(void *bp) { return (char *)bp - WSIZE; }
 static inline void *footer_ptr(void *bp) {
-    return (char *)bp + get_size(header_ptr(bp)) - 2 * sizeof(size_t);
+    return (char *)bp + get_size(header_ptr(bp)) - 2 * WSIZE;
 }
 static inline void *prev_footer_ptr(void *bp) {
-    return (char *)bp - 2 * sizeof(size_t);
+    return (char *)bp - 2 * WSIZE;
 }
 static inline void *next_block(void *bp) {
     return (char *)bp + get_size(header_ptr(bp));
@@ -134,7 +296,7 @@ static inline void *prev_block(void *bp) {
     return (char *)bp - get_size(prev_footer_ptr(bp));
 }
 static inline void sync_footer(void *bp) {
-    *(size_t *)footer_ptr(bp) = *(size_t *)header_ptr(bp);
+    *(word_t *)footer_ptr(bp) = *(word_t *)header_ptr(bp);
 }
 
 typedef struct list_node {
@@ -158,10 +320,468 @@ static inline void list_erase(list_node_t *node) {
 static inline list_node_t *list_begin(list_node_t *head) { return head->next; }
 static inline list_node_t *list_end(list_node_t *head) { return head; }
 
+typedef struct tree_node {
+    struct tree_node *left;
+    struct tree_node *right;
+} tree_node_t;
+
+/*
+ * The size a node is keyed by. Address-ordered free lists key their trees by
+ * address alone, which is the same as keying every node by size 0.
+ */
+static inline size_t tree_key_size(tree_node_t *node) {
+#ifdef MM_ADDRESS_ORDERED
+    return 0;
+#else
+    return get_size(header_ptr(node));
+#endif
+}
+
+/*
+ * Orders free blocks by (size, address). A NULL addr compares less than every
+ * block of the same size.
+ */
+static inline int tree_compare(size_t size, void *addr, tree_node_t *node) {
+    size_t node_size = tree_key_size(node);
+    if (size != node_size) {
+        return size < node_size ? -1 : 1;
+    }
+    if (addr != (void *)node) {
+        return (char *)addr < (char *)node ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+ * Top-down splay. Returns the new root, which is the node with the given key
+ * if it exists, or otherwise its predecessor or successor.
+ */
+static tree_node_t *tree_splay(tree_node_t *root, size_t size, void *addr) {
+    if (root == NULL) {
+        return NULL;
+    }
+    tree_node_t dummy = {NULL, NULL};
+    tree_node_t *l = &dummy, *r = &dummy, *t = root, *y;
+    for (;;) {
+        int cmp = tree_compare(size, addr, t);
+        if (cmp < 0) {
+            if (t->left == NULL) {
+                break;
+            }
+            if (tree_compare(size, addr, t->left) < 0) {
+                // rotate right
+                y = t->left;
+                t->left = y->right;
+                y->right = t;
+                t = y;
+                if (t->left == NULL) {
+                    break;
+                }
+            }
+            // link right
+            r->left = t;
+            r = t;
+            t = t->left;
+        } else if (cmp > 0) {
+            if (t->right == NULL) {
+                break;
+            }
+            if (tree_compare(size, addr, t->right) > 0) {
+                // rotate left
+                y = t->right;
+                t->right = y->left;
+                y->left = t;
+                t = y;
+                if (t->right == NULL) {
+                    break;
+                }
+            }
+            // link left
+            l->right = t;
+            l = t;
+            t = t->right;
+        } else {
+            break;
+        }
+    }
+    l->right = t->left;
+    r->left = t->right;
+    t->left = dummy.right;
+    t->right = dummy.left;
+    return t;
+}
+static inline void tree_insert(tree_node_t **root, tree_node_t *node) {
+    size_t size = tree_key_size(node);
+    tree_node_t *t = tree_splay(*root, size, node);
+    if (t == NULL) {
+        node->left = node->right = NULL;
+    } else if (tree_compare(size, node, t) < 0) {
+        node->left = t->left;
+        node->right = t;
+        t->left = NULL;
+    } else {
+        node->right = t->right;
+        node->left = t;
+        t->right = NULL;
+    }
+    *root = node;
+}
+static inline void tree_erase(tree_node_t **root, tree_node_t *node) {
+    size_t size = tree_key_size(node);
+    tree_node_t *t = tree_splay(*root, size, node);
+    assert(t == node && "block not found in free tree");
+    if (t->left == NULL) {
+        *root = t->right;
+    } else {
+        // all keys on the left are smaller, so the splayed root has no right
+        *root = tree_splay(t->left, size, node);
+        (*root)->right = t->right;
+    }
+}
+/* Returns the smallest block of at least the given size, or NULL */
+static inline tree_node_t *tree_lower_bound(tree_node_t **root, size_t size) {
+    tree_node_t *t = *root = tree_splay(*root, size, NULL);
+    if (t == NULL || tree_compare(size, NULL, t) < 0) {
+        return t;
+    }
+    for (t = t->right; t != NULL && t->left != NULL; t = t->left) {
+    }
+    return t;
+}
+/* Returns the block following node, which must be in the tree, or NULL */
+static inline tree_node_t *tree_next(tree_node_t **root, tree_node_t *node) {
+    tree_node_t *t = *root = tree_splay(*root, tree_key_size(node), node);
+    assert(t == node && "block not found in free tree");
+    for (t = t->right; t != NULL && t->left != NULL; t = t->left) {
+    }
+    return t;
+}
+
+/*
+ * Free blocks of the explicit and segregated free lists are kept in a
+ * free_list_t, and each free block holds a free_node_t in its payload. Lists
+ * are walked with free_node_first and free_node_next.
+ *
+ * By default a free list is doubly linked, with new blocks pushed at the front
+ * (LIFO order). A free list is then a link_t to its first block, with the
+ * first block having no prev and the last one no next. A link is a pointer, or
+ * with MM_COMPACT a 32-bit offset from heap_base, the start of the memlib
+ * regions, with offset 0 meaning no block. All memlib regions lie within 4 GB
+ * of heap_base, and no payload starts at heap_base itself.
+ *
+ * With MM_ADDRESS_ORDERED, a free list is a splay tree keyed by address
+ * instead, so that blocks are inserted in address order in logarithmic
+ * amortized time and walked from the lowest address. Stepping to the next
+ * block splays the current one, which costs amortized constant time over a
+ * whole walk. Tree nodes hold full pointers even with MM_COMPACT.
+ */
+#ifdef MM_COMPACT
+static char *heap_base;
+#endif
+
+#ifdef MM_ADDRESS_ORDERED
+typedef tree_node_t free_node_t;
+typedef tree_node_t *free_list_t;
+
+static inline void free_list_clear(free_list_t *list) { *list = NULL; }
+static inline int free_list_empty(free_list_t list) { return list == NULL; }
+static inline free_node_t *free_node_first(free_list_t *list) {
+    return tree_lower_bound(list, 0);
+}
+static inline free_node_t *free_node_next(free_list_t *list,
+                                          free_node_t *node) {
+    return tree_next(list, node);
+}
+static inline void free_node_insert(free_list_t *list, free_node_t *node) {
+    tree_insert(list, node);
+}
+static inline void free_node_erase(free_list_t *list, free_node_t *node) {
+    tree_erase(list, node);
+}
+/*
+ * Checks that node can be found from the root without splaying, which fails
+ * for nodes out of address order
+ */
+static inline int free_node_linked(free_list_t list, free_node_t *node) {
+    while (list != NULL && list != node) {
+        list = (char *)node < (char *)list ? list->left : list->right;
+    }
+    return list == node;
+}
+#else
+#ifdef MM_COMPACT
+typedef uint32_t link_t;
+#else
+typedef struct free_node *link_t;
+#endif
+
+typedef struct free_node {
+    link_t prev;
+    link_t next;
+} free_node_t;
+typedef link_t free_list_t;
+
+#ifdef MM_COMPACT
+static inline free_node_t *link_get(link_t link) {
+    return link ? (free_node_t *)(heap_base + link) : NULL;
+}
+static inline link_t link_of(free_node_t *node) {
+    return node ? (link_t)((char *)node - heap_base) : 0;
+}
+#else
+static inline free_node_t *link_get(link_t link) { return link; }
+static inline link_t link_of(free_node_t *node) { return node; }
+#endif
+
+static inline void free_list_clear(free_list_t *list) { *list = link_of(NULL); }
+static inline int free_list_empty(free_list_t list) {
+    return link_get(list) == NULL;
+}
+static inline free_node_t *free_node_first(free_list_t *list) {
+    return link_get(*list);
+}
+static inline free_node_t *free_node_next(free_list_t *list,
+                                          free_node_t *node) {
+    return link_get(node->next);
+}
+static inline void free_node_insert(free_list_t *list, free_node_t *node) {
+    free_node_t *first = link_get(*list);
+    node->prev = link_of(NULL);
+    node->next = *list;
+    if (first != NULL) {
+        first->prev = link_of(node);
+    }
+    *list = link_of(node);
+}
+static inline void free_node_erase(free_list_t *list, free_node_t *node) {
+    free_node_t *prev = link_get(node->prev);
+    free_node_t *next = link_get(node->next);
+    if (prev != NULL) {
+        prev->next = node->next;
+    } else {
+        *list = node->next;
+    }
+    if (next != NULL) {
+        next->prev = node->prev;
+    }
+}
+/* Checks that the neighbors of node link back to it */
+static inline int free_node_linked(free_list_t list, free_node_t *node) {
+    free_node_t *prev = link_get(node->prev);
+    free_node_t *next = link_get(node->next);
+    return (prev != NULL ? prev->next : list) == link_of(node) &&
+           (next == NULL || next->prev == link_of(node));
+}
+#endif
+
+#define SEGREGATED_NUM_LISTS 64
+
+#define QUICK_NUM_LISTS 32
+
+#define SLAB_NUM_CLASSES 16
+#define SLAB_RUN_SHIFT 12
+#define SLAB_MAX_OBJS (1 << (SLAB_RUN_SHIFT - 3))
+#define SLAB_MAP_CHUNKS (1 << 14)
+
+#define CHECK_NUM_TOUCHED 8
+
+// mm_footprint counts 2 MB huge page frames
+#define FOOTPRINT_HUGE_SHIFT 21
+
+// MM_PROFILE counts requests per free list class, or per power of two
+#ifdef MM_SEGREGATED
+#define PROFILE_NUM_CLASSES SEGREGATED_NUM_LISTS
+#else
+#define PROFILE_NUM_CLASSES MM_STATS_CLASSES
+#endif
+// find_fit walks of 0, 1, 2-3, 4-7, ... blocks, the last bucket unbounded
+#define PROFILE_NUM_WALKS 16
+
+/*
+ * Counters behind mm_stats. Free blocks are counted as they enter and leave
+ * the free list, so the counters are always up to date. Only the thread that
+ * holds the heap lock writes them, with stats_set, and mm_stats reads them
+ * without the lock.
+ *
+ * The largest free block of each class only grows as blocks are linked. When
+ * it leaves the free list, the class is marked stale and keeps its old size
+ * as an upper bound. Only when the largest block of the heap leaves does
+ * heap_unlock look up its successor, in the highest non-empty class, and
+ * only if that class is stale.
+ */
+typedef struct {
+    size_t heap_bytes;
+    size_t free_bytes;
+    size_t free_blocks[MM_STATS_CLASSES];
+    size_t free_class_bytes[MM_STATS_CLASSES];
+    size_t free_class_max[MM_STATS_CLASSES];
+    uint32_t stale_classes;
+    size_t largest_free;
+    int stale_largest;
+    unsigned long extends;
+    unsigned long splits;
+    unsigned long coalesces;
+} heap_stats_t;
+
+#define stats_set(field, value)                                                \
+    __atomic_store_n(&heap->stats.field, (value), __ATOMIC_RELAXED)
+#define stats_get(h, field) __atomic_load_n(&(h)->stats.field, __ATOMIC_RELAXED)
+
+static inline size_t stats_class(size_t size) {
+    size_t cls = 8 * sizeof(unsigned long) - 1 - __builtin_clzl(size);
+    return MIN(cls, MM_STATS_CLASSES - 1);
+}
+static inline size_t stats_class_max(size_t cls) {
+    return cls < MM_STATS_CLASSES - 1 ? ((size_t)2 << cls) - 1 : SIZE_MAX;
+}
+
+#ifdef MM_PROFILE
+/* Counters of MM_PROFILE for a free list class or a request size bucket */
+typedef struct {
+    unsigned long mallocs;
+    unsigned long frees;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long splits;
+    unsigned long walked;
+    unsigned long walks[PROFILE_NUM_WALKS];
+} profile_row_t;
+
+typedef struct {
+    profile_row_t classes[PROFILE_NUM_CLASSES];
+    profile_row_t requests[MM_STATS_CLASSES];
+    size_t request; // bytes requested by the current request, 0 if internal
+    size_t steps;   // blocks find_fit has looked at for it
+} heap_profile_t;
+#endif
+
+/*
+ * All mutable state of a heap. A single-arena build has exactly one heap.
+ * With MM_ARENAS, each arena owns a heap grown in its own memlib region, and
+ * `heap` points to the arena the calling thread is currently operating on.
+ */
+typedef struct {
+    void *block_head;
+    void *block_tail;
+#if defined(MM_EXPLICIT)
+    free_list_t free_list;
+#elif defined(MM_SEGREGATED)
+    free_list_t free_lists[SEGREGATED_NUM_LISTS];
+    uint64_t free_lists_bitmap;
+#elif defined(MM_TREE)
+    tree_node_t *free_tree;
+#endif
+#ifdef MM_DEFERRED_COALESCING
+    void *quick_lists[QUICK_NUM_LISTS];
+    size_t quick_bytes;
+#endif
+#ifdef MM_SLAB
+    list_node_t slab_runs[SLAB_NUM_CLASSES];
+    uintptr_t slab_base;
+    uint8_t slab_map[SLAB_MAP_CHUNKS / 8];
+#endif
+    heap_stats_t stats;
+#ifdef MM_PROFILE
+    heap_profile_t profile;
+#endif
+    void *fresh;
+    void *placed;
+    void *placed_zero;
+#ifdef MM_CHECK_INCREMENTAL
+    void *check_touched[CHECK_NUM_TOUCHED];
+    void *check_cursor;
+    size_t check_round;
+#endif
+#ifdef MM_THREAD_SAFE
+    pthread_mutex_t lock;
+    unsigned long lock_acquired;
+    unsigned long lock_contended;
+#endif
+#ifdef MM_REMOTE_FREE
+    void *remote_frees;
+    size_t remote_count;
+#endif
+} heap_t;
+
+#ifdef MM_ARENAS
+static heap_t arenas[MM_ARENAS];
+static __thread heap_t *heap;
+
+static inline heap_t *heap_owner(void *ptr) {
+    int idx;
+    if (ptr != NULL && (idx = mem_arena_of(ptr)) >= 0) {
+        assert(idx < MM_ARENAS && "pointer outside of all arenas");
+        return &arenas[idx];
+    }
+    // mapped chunks belong to no arena and go to the one of the thread
+#ifdef MM_ARENA_PERCPU
+    int cpu = sched_getcpu();
+    return &arenas[(cpu < 0 ? 0 : cpu) % MM_ARENAS];
+#else
+    // assign arenas to threads round-robin on their first allocation
+    static size_t next_arena;
+    static __thread heap_t *thread_arena;
+    if (thread_arena == NULL) {
+        size_t idx = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED);
+        thread_arena = &arenas[idx % MM_ARENAS];
+    }
+    return thread_arena;
+#endif
+}
+static inline void *heap_sbrk(int incr) {
+    return mem_arena_sbrk(heap - arenas, incr);
+}
+static inline void *heap_fresh() { return mem_arena_fresh(heap - arenas); }
+#else
+static heap_t main_heap;
+static heap_t *const heap = &main_heap;
+
+static inline heap_t *heap_owner(void *ptr) { return heap; }
+static inline void *heap_sbrk(int incr) { return mem_sbrk(incr); }
+static inline void *heap_fresh() { return mem_arena_fresh(0); }
+#endif
+
+static inline void heap_lock() {
+#ifdef MM_THREAD_SAFE
+    if (pthread_mutex_trylock(&heap->lock) != 0) {
+        pthread_mutex_lock(&heap->lock);
+        heap->lock_contended++;
+    }
+    heap->lock_acquired++;
+#endif
+}
+static void stats_refresh();
+
+static inline void heap_unlock() {
+    if (heap->stats.stale_largest) {
+        stats_refresh();
+    }
+#ifdef MM_THREAD_SAFE
+    pthread_mutex_unlock(&heap->lock);
+#endif
+}
+/*
+ * Switches to the heap owning ptr, or to the heap of the calling thread if ptr
+ * is NULL, and locks it.
+ */
+static inline void heap_enter(void *ptr) {
+#ifdef MM_ARENAS
+    heap = heap_owner(ptr);
+#endif
+    heap_lock();
+}
+
+/* Counts a block looked at by find_fit, for MM_PROFILE */
+static inline void profile_step() {
+#ifdef MM_PROFILE
+    heap->profile.steps++;
+#endif
+}
+
 static inline void mm_print_heap() {
     printf("  HEAP: ");
     void *bp;
-    for (bp = block_head; bp != block_tail; bp = next_block(bp)) {
+    for (bp = heap->block_head; bp != heap->block_tail; bp = next_block(bp)) {
         printf("[%d/%d/%d %p] -> ", get_size(header_ptr(bp)),
                get_prev_alloc(header_ptr(bp)), get_alloc(header_ptr(bp)), bp);
     }
@@ -169,9 +789,9 @@ static inline void mm_print_heap() {
            get_prev_alloc(header_ptr(bp)), get_alloc(header_ptr(bp)), bp);
 }
 
-static inline void mm_print_list(list_node_t *head) {
-    for (list_node_t *fp = list_begin(head); fp != list_end(head);
-         fp = fp->next) {
+static inline void mm_print_list(free_list_t *list) {
+    for (free_node_t *fp = free_node_first(list); fp != NULL;
+         fp = free_node_next(list, fp)) {
         printf("[%d/%d/%d %p] -> ", get_size(header_ptr(fp)),
                get_prev_alloc(header_ptr(fp)), get_alloc(header_ptr(fp)),
                (void *)fp);
@@ -179,29 +799,66 @@ static inline void mm_print_list(list_node_t *head) {
     printf("NULL\n");
 }
 
+/* Checks the block at bp and its boundary with the next block */
+static inline void mm_check_block(void *bp, size_t min_block_size) {
+    if (bp != heap->block_head) {
+        assert(get_size(header_ptr(bp)) >= min_block_size &&
+               "block size is too small");
+    } else {
+        assert(get_size(header_ptr(bp)) == 2 * WSIZE &&
+               get_alloc(header_ptr(bp)) && "corrupted head block");
+    }
+    if (!get_alloc(header_ptr(bp))) {
+        assert(*(word_t *)footer_ptr(bp) == *(word_t *)header_ptr(bp) &&
+               "header & footer must be the same for free block");
+        assert(get_prev_alloc(header_ptr(bp)) &&
+               get_alloc(header_ptr(next_block(bp))) &&
+               "uncoalesced adjacent free blocks");
+    }
+    assert(get_alloc(header_ptr(bp)) ==
+               get_prev_alloc(header_ptr(next_block(bp))) &&
+           "inconsistent alloc & prev_alloc");
+}
+
+static inline void mm_check_tail() {
+    assert(get_size(header_ptr(heap->block_tail)) == 0 &&
+           get_alloc(header_ptr(heap->block_tail)) == 1 &&
+           "corrupted block tail");
+}
+
 static inline void mm_check_heap(size_t min_block_size) {
-    void *bp;
-    for (bp = block_head; bp != block_tail; bp = next_block(bp)) {
-        if (bp != block_head) {
-            assert(get_size(header_ptr(bp)) >= min_block_size &&
-                   "block size is too small");
-        } else {
-            assert(get_size(header_ptr(bp)) == 2 * sizeof(size_t) &&
-                   get_alloc(header_ptr(bp)) && "corrupted head block");
-        }
+    size_t free_bytes = 0, free_blocks = 0, largest = 0;
+    size_t class_max[MM_STATS_CLASSES] = {0};
+    for (void *bp = heap->block_head; bp != heap->block_tail;
+         bp = next_block(bp)) {
+        mm_check_block(bp, min_block_size);
         if (!get_alloc(header_ptr(bp))) {
-            assert(*(size_t *)footer_ptr(bp) == *(size_t *)header_ptr(bp) &&
-                   "header & footer must be the same for free block");
-            assert(get_prev_alloc(header_ptr(bp)) &&
-                   get_alloc(header_ptr(next_block(bp))) &&
-                   "uncoalesced adjacent free blocks");
+            size_t size = get_size(header_ptr(bp));
+            size_t cls = stats_class(size);
+            free_bytes += size;
+            free_blocks++;
+            class_max[cls] = MAX(class_max[cls], size);
+            largest = MAX(largest, size);
         }
-        assert(get_alloc(header_ptr(bp)) ==
-                   get_prev_alloc(header_ptr(next_block(bp))) &&
-               "inconsistent alloc & prev_alloc");
     }
-    assert(get_size(header_ptr(bp)) == 0 && get_alloc(header_ptr(bp)) == 1 &&
-           "corrupted block tail");
+    mm_check_tail();
+
+    for (size_t i = 0; i < MM_STATS_CLASSES; i++) {
+        free_blocks -= heap->stats.free_blocks[i];
+        // the largest block of a stale class is only known to be no larger
+        assert(((heap->stats.stale_classes >> i) & 1
+                    ? class_max[i] <= heap->stats.free_class_max[i]
+                    : class_max[i] == heap->stats.free_class_max[i]) &&
+               "largest free block of class disagrees with heap");
+    }
+    assert(free_bytes == heap->stats.free_bytes && free_blocks == 0 &&
+           "free block statistics disagree with heap");
+    assert((heap->stats.stale_largest || largest == heap->stats.largest_free) &&
+           "largest free block disagrees with heap");
+    assert(heap->stats.heap_bytes == (size_t)((char *)heap->block_tail -
+                                              (char *)heap->block_head -
+                                              2 * WSIZE) &&
+           "heap size disagrees with heap");
 }
 
 #if defined(MM_IMPLICIT)
@@ -213,22 +870,25 @@ static inline void mm_check_heap(size_t min_block_size) {
  * allocator traverses along the entire heap to find a free block.
  */
 
-static const size_t IMPLICIT_MIN_BLOCK_SIZE = 2 * sizeof(size_t);
+// room for the footer when free, or for a quick list link
+#define IMPLICIT_MIN_BLOCK_SIZE ALIGN(2 * sizeof(void *))
 
 static inline void implicit_free_list_init() {}
 static inline void implicit_free_list_insert(void *bp) {}
 static inline void implicit_free_list_erase(void *bp) {}
-static inline void implicit_free_list_update(void *bp) {}
 
 static inline void implicit_mm_print() { mm_print_heap(); }
 
 static inline void implicit_mm_check() {
     mm_check_heap(IMPLICIT_MIN_BLOCK_SIZE);
 }
+static inline void implicit_mm_check_sample(size_t round, size_t window) {}
+static inline int implicit_free_list_contains(void *bp) { return 1; }
 
 static inline void *implicit_find_first_fit(size_t alloc_size) {
-    for (void *bp = next_block(block_head); bp != block_tail;
+    for (void *bp = next_block(heap->block_head); bp != heap->block_tail;
          bp = next_block(bp)) {
+        profile_step();
         if (!get_alloc(header_ptr(bp)) &&
             get_size(header_ptr(bp)) >= alloc_size) {
             return bp;
@@ -240,8 +900,9 @@ static inline void *implicit_find_first_fit(size_t alloc_size) {
 static inline void *implicit_find_best_fit(size_t alloc_size) {
     void *best_bp = NULL;
     size_t best_size = SIZE_MAX;
-    for (void *bp = next_block(block_head); bp != block_tail;
+    for (void *bp = next_block(heap->block_head); bp != heap->block_tail;
          bp = next_block(bp)) {
+        profile_step();
         size_t block_size = get_size(header_ptr(bp));
         if (!get_alloc(header_ptr(bp)) && block_size >= alloc_size &&
             block_size < best_size) {
@@ -252,13 +913,28 @@ static inline void *implicit_find_best_fit(size_t alloc_size) {
     return best_bp;
 }
 
+/* Largest free block of lo to hi bytes, 0 if none */
+static inline size_t implicit_find_largest(size_t lo, size_t hi) {
+    size_t largest = 0;
+    for (void *bp = next_block(heap->block_head); bp != heap->block_tail;
+         bp = next_block(bp)) {
+        size_t size = get_size(header_ptr(bp));
+        if (!get_alloc(header_ptr(bp)) && lo <= size && size <= hi) {
+            largest = MAX(largest, size);
+        }
+    }
+    return largest;
+}
+
 #define MIN_BLOCK_SIZE IMPLICIT_MIN_BLOCK_SIZE
 #define free_list_init implicit_free_list_init
 #define free_list_insert implicit_free_list_insert
 #define free_list_erase implicit_free_list_erase
-#define free_list_update implicit_free_list_update
 #define do_mm_check implicit_mm_check
 #define do_mm_print implicit_mm_print
+#define do_mm_check_sample implicit_mm_check_sample
+#define free_list_contains implicit_free_list_contains
+#define find_largest implicit_find_largest
 
 #if defined(MM_FIRST_FIT)
 #define find_fit implicit_find_first_fit
@@ -278,40 +954,50 @@ static inline void *implicit_find_best_fit(size_t alloc_size) {
  * the free list to find a proper free block.
  */
 
-static list_node_t explicit_free_list;
-
-static const size_t EXPLICIT_MIN_BLOCK_SIZE =
-    2 * sizeof(size_t) + 2 * sizeof(list_node_t *);
+#define EXPLICIT_MIN_BLOCK_SIZE ALIGN(2 * WSIZE + sizeof(free_node_t))
 
-static inline void explicit_free_list_init() { list_init(&explicit_free_list); }
+static inline void explicit_free_list_init() {
+    free_list_clear(&heap->free_list);
+}
 static inline void explicit_free_list_insert(void *bp) {
-    list_push_front(&explicit_free_list, bp);
+    free_node_insert(&heap->free_list, bp);
+}
+static inline void explicit_free_list_erase(void *bp) {
+    free_node_erase(&heap->free_list, bp);
 }
-static inline void explicit_free_list_erase(void *bp) { list_erase(bp); }
-static inline void explicit_free_list_update(void *bp) {}
 
 static inline void explicit_mm_print() {
     mm_print_heap();
 
     printf("  FREE: ");
-    mm_print_list(&explicit_free_list);
+    mm_print_list(&heap->free_list);
 }
 
-static inline void explicit_mm_check() {
-    mm_check_heap(EXPLICIT_MIN_BLOCK_SIZE);
-
-    for (list_node_t *fp = list_begin(&explicit_free_list);
-         fp != list_end(&explicit_free_list); fp = fp->next) {
+// checks the first window blocks of the free list
+static inline void explicit_mm_check_list(size_t window) {
+    for (free_node_t *fp = free_node_first(&heap->free_list);
+         fp != NULL && window-- > 0; fp = free_node_next(&heap->free_list, fp)) {
         assert(!get_alloc(header_ptr(fp)) &&
                "blocks in free list must be unallocated");
-        assert(fp->prev->next == fp && fp->next->prev == fp &&
-               "corrupted free list");
+        assert(free_node_linked(heap->free_list, fp) && "corrupted free list");
     }
 }
 
+static inline void explicit_mm_check() {
+    mm_check_heap(EXPLICIT_MIN_BLOCK_SIZE);
+    explicit_mm_check_list(SIZE_MAX);
+}
+static inline void explicit_mm_check_sample(size_t round, size_t window) {
+    explicit_mm_check_list(window);
+}
+static inline int explicit_free_list_contains(void *bp) {
+    return free_node_linked(heap->free_list, bp);
+}
+
 static inline void *explicit_find_first_fit(size_t alloc_size) {
-    for (list_node_t *fp = list_begin(&explicit_free_list);
-         fp != list_end(&explicit_free_list); fp = fp->next) {
+    for (free_node_t *fp = free_node_first(&heap->free_list); fp != NULL;
+         fp = free_node_next(&heap->free_list, fp)) {
+        profile_step();
         if (get_size(header_ptr(fp)) >= alloc_size) {
             return fp;
         }
@@ -322,8 +1008,9 @@ static inline void *explicit_find_first_fit(size_t alloc_size) {
 static inline void *explicit_find_best_fit(size_t alloc_size) {
     void *best_bp = NULL;
     size_t best_size = SIZE_MAX;
-    for (list_node_t *fp = list_begin(&explicit_free_list);
-         fp != list_end(&explicit_free_list); fp = fp->next) {
+    for (free_node_t *fp = free_node_first(&heap->free_list); fp != NULL;
+         fp = free_node_next(&heap->free_list, fp)) {
+        profile_step();
         size_t block_size = get_size(header_ptr(fp));
         if (block_size >= alloc_size && block_size < best_size) {
             best_size = block_size;
@@ -333,13 +1020,28 @@ static inline void *explicit_find_best_fit(size_t alloc_size) {
     return best_bp;
 }
 
+/* Largest free block of lo to hi bytes, 0 if none */
+static inline size_t explicit_find_largest(size_t lo, size_t hi) {
+    size_t largest = 0;
+    for (free_node_t *fp = free_node_first(&heap->free_list); fp != NULL;
+         fp = free_node_next(&heap->free_list, fp)) {
+        size_t size = get_size(header_ptr(fp));
+        if (lo <= size && size <= hi) {
+            largest = MAX(largest, size);
+        }
+    }
+    return largest;
+}
+
 #define MIN_BLOCK_SIZE EXPLICIT_MIN_BLOCK_SIZE
 #define free_list_init explicit_free_list_init
 #define free_list_insert explicit_free_list_insert
 #define free_list_erase explicit_free_list_erase
-#define free_list_update explicit_free_list_update
 #define do_mm_check explicit_mm_check
 #define do_mm_print explicit_mm_print
+#define do_mm_check_sample explicit_mm_check_sample
+#define free_list_contains explicit_free_list_contains
+#define find_largest explicit_find_largest
 
 #if defined(MM_FIRST_FIT)
 #define find_fit explicit_find_first_fit
@@ -353,53 +1055,87 @@ static inline void *explicit_find_best_fit(size_t alloc_size) {
 /*
  * Memory malloc using segregated free list.
  *
- * Block sizes are divided into multiple size classes. Here we define 10 size
- * classes: {16}, {17-32}, {33-64}, ..., {4097-inf}. For each size class, we
- * maintain a free list that only holds free blocks belonging to this size
- * class. When a block is freed, we first determine its size class, and insert
- * it into the free list of this size class. When a block is allocated, it is
- * removed from the list of its size class. When a free block is coalesced with
- * other blocks, its size class may have changed and it needs to be removed and
- * re-inserted into the correct free list.
+ * Block sizes are divided into SEGREGATED_NUM_LISTS size classes. Small blocks
+ * below SEGREGATED_SMALL_SIZE get one exact class per aligned size, and larger
+ * ones get SEGREGATED_SUB_LISTS classes per power of two, e.g. {256-319},
+ * {320-383}, {384-447}, {448-511}, {512-639}, ..., with the last class being
+ * unbounded. For each size class, we maintain a free list that only holds free
+ * blocks belonging to this size class. When a block is freed, we first
+ * determine its size class, and insert it into the free list of this size
+ * class. When a block is allocated, it is removed from the list of its size
+ * class. When a free block is coalesced with other blocks, its size class may
+ * have changed and it needs to be removed and re-inserted into the correct
+ * free list.
+ *
+ * A bitmap records which free lists are non-empty. Any block in a class above
+ * the class of the request fits, so after checking its own class a lookup
+ * jumps straight to the first non-empty larger class with a find-first-set,
+ * regardless of how many classes are empty.
  */
 
-static const size_t SEGREGATED_MIN_BLOCK_SIZE =
-    2 * sizeof(size_t) + 2 * sizeof(list_node_t *);
+#define SEGREGATED_MIN_BLOCK_SIZE ALIGN(2 * WSIZE + sizeof(free_node_t))
 
-#define SEGREGATED_NUM_LISTS 10
-static list_node_t segregated_free_lists[SEGREGATED_NUM_LISTS];
+static const size_t SEGREGATED_SMALL_SHIFT = 8;
+static const size_t SEGREGATED_SMALL_SIZE = 1 << SEGREGATED_SMALL_SHIFT;
+static const size_t SEGREGATED_SUB_SHIFT = 2;
+static const size_t SEGREGATED_SUB_LISTS = 1 << SEGREGATED_SUB_SHIFT;
 
+static inline size_t segregated_num_small_lists() {
+    return (SEGREGATED_SMALL_SIZE - SEGREGATED_MIN_BLOCK_SIZE) / ALIGNMENT;
+}
 static inline void segregated_free_list_init() {
     for (size_t i = 0; i < SEGREGATED_NUM_LISTS; i++) {
-        list_init(&segregated_free_lists[i]);
+        free_list_clear(&heap->free_lists[i]);
     }
+    heap->free_lists_bitmap = 0;
 }
 static inline size_t segregated_free_list_min_size(size_t index) {
-    return index ? ((SEGREGATED_MIN_BLOCK_SIZE << (index - 1)) + 1)
-                 : SEGREGATED_MIN_BLOCK_SIZE;
+    size_t num_small = segregated_num_small_lists();
+    if (index < num_small) {
+        return SEGREGATED_MIN_BLOCK_SIZE + index * ALIGNMENT;
+    }
+    size_t shift = SEGREGATED_SMALL_SHIFT + (index - num_small) /
+                                                SEGREGATED_SUB_LISTS;
+    size_t sub = (index - num_small) % SEGREGATED_SUB_LISTS;
+    return ((size_t)1 << shift) + (sub << (shift - SEGREGATED_SUB_SHIFT));
 }
 static inline size_t segregated_free_list_max_size(size_t index) {
     return (index < SEGREGATED_NUM_LISTS - 1)
-               ? (SEGREGATED_MIN_BLOCK_SIZE << index)
+               ? segregated_free_list_min_size(index + 1) - 1
                : SIZE_MAX;
 }
 static inline size_t segregated_free_list_lower_bound(size_t size) {
     assert(size >= SEGREGATED_MIN_BLOCK_SIZE && "block is too small");
-    size_t index = 0;
-    for (size = (size - 1) / SEGREGATED_MIN_BLOCK_SIZE; size; size >>= 1) {
-        index++;
+    if (size < SEGREGATED_SMALL_SIZE) {
+        return (size - SEGREGATED_MIN_BLOCK_SIZE) / ALIGNMENT;
     }
+    size_t shift = 8 * sizeof(unsigned long) - 1 - __builtin_clzl(size);
+    size_t sub = (size >> (shift - SEGREGATED_SUB_SHIFT)) &
+                 (SEGREGATED_SUB_LISTS - 1);
+    size_t index = segregated_num_small_lists() +
+                   (shift - SEGREGATED_SMALL_SHIFT) * SEGREGATED_SUB_LISTS +
+                   sub;
     return MIN(index, SEGREGATED_NUM_LISTS - 1);
 }
+/* Returns the first non-empty class above index, or SEGREGATED_NUM_LISTS */
+static inline size_t segregated_free_list_next_nonempty(size_t index) {
+    uint64_t mask = (index + 1 < SEGREGATED_NUM_LISTS)
+                        ? heap->free_lists_bitmap >> (index + 1) << (index + 1)
+                        : 0;
+    return mask ? (size_t)__builtin_ctzll(mask) : SEGREGATED_NUM_LISTS;
+}
 static inline void segregated_free_list_insert(void *bp) {
     size_t size = get_size(header_ptr(bp));
     size_t idx = segregated_free_list_lower_bound(size);
-    list_push_front(&segregated_free_lists[idx], bp);
+    free_node_insert(&heap->free_lists[idx], bp);
+    heap->free_lists_bitmap |= (uint64_t)1 << idx;
 }
-static inline void segregated_free_list_erase(void *bp) { list_erase(bp); }
-static inline void segregated_free_list_update(void *bp) {
-    segregated_free_list_erase(bp);
-    segregated_free_list_insert(bp);
+static inline void segregated_free_list_erase(void *bp) {
+    size_t idx = segregated_free_list_lower_bound(get_size(header_ptr(bp)));
+    free_node_erase(&heap->free_lists[idx], bp);
+    if (free_list_empty(heap->free_lists[idx])) {
+        heap->free_lists_bitmap &= ~((uint64_t)1 << idx);
+    }
 }
 
 static inline void segregated_mm_print() {
@@ -408,7 +1144,24 @@ static inline void segregated_mm_print() {
     for (size_t i = 0; i < SEGREGATED_NUM_LISTS; i++) {
         printf("  FREE[%d] [%zu,%zu]: ", i, segregated_free_list_min_size(i),
                segregated_free_list_max_size(i));
-        mm_print_list(&segregated_free_lists[i]);
+        mm_print_list(&heap->free_lists[i]);
+    }
+}
+
+// checks the first window blocks of free list i
+static inline void segregated_mm_check_list(size_t i, size_t window) {
+    free_list_t *list = &heap->free_lists[i];
+    size_t min_size = segregated_free_list_min_size(i);
+    size_t max_size = segregated_free_list_max_size(i);
+    assert(((heap->free_lists_bitmap >> i) & 1) == !free_list_empty(*list) &&
+           "bitmap disagrees with free list");
+    for (free_node_t *fp = free_node_first(list); fp != NULL && window-- > 0;
+         fp = free_node_next(list, fp)) {
+        size_t size = get_size(header_ptr(fp));
+        assert(min_size <= size && size <= max_size && "invalid block size");
+        assert(!get_alloc(header_ptr(fp)) &&
+               "blocks in free list must be unallocated");
+        assert(free_node_linked(*list, fp) && "corrupted free list");
     }
 }
 
@@ -416,44 +1169,47 @@ static inline void segregated_mm_check() {
     mm_check_heap(SEGREGATED_MIN_BLOCK_SIZE);
 
     for (size_t i = 0; i < SEGREGATED_NUM_LISTS; i++) {
-        list_node_t *list = &segregated_free_lists[i];
-        size_t min_size = segregated_free_list_min_size(i);
-        size_t max_size = segregated_free_list_max_size(i);
-        for (list_node_t *fp = list_begin(list); fp != list_end(list);
-             fp = fp->next) {
-            size_t size = get_size(header_ptr(fp));
-            assert(min_size <= size && size <= max_size &&
-                   "invalid block size");
-            assert(!get_alloc(header_ptr(fp)) &&
-                   "blocks in free list must be unallocated");
-            assert(fp->prev->next == fp && fp->next->prev == fp &&
-                   "corrupted free list");
-        }
+        segregated_mm_check_list(i, SIZE_MAX);
     }
 }
+// checks one list per round, so that every list is visited in turn
+static inline void segregated_mm_check_sample(size_t round, size_t window) {
+    segregated_mm_check_list(round % SEGREGATED_NUM_LISTS, window);
+}
+static inline int segregated_free_list_contains(void *bp) {
+    size_t idx = segregated_free_list_lower_bound(get_size(header_ptr(bp)));
+    return (heap->free_lists_bitmap >> idx & 1) &&
+           free_node_linked(heap->free_lists[idx], bp);
+}
 
 static inline void *segregated_find_first_fit(size_t alloc_size) {
-    for (size_t i = segregated_free_list_lower_bound(alloc_size);
-         i < SEGREGATED_NUM_LISTS; i++) {
-        list_node_t *list = &segregated_free_lists[i];
-        for (list_node_t *fp = list_begin(list); fp != list_end(list);
-             fp = fp->next) {
-            if (get_size(header_ptr(fp)) >= alloc_size) {
-                return fp;
-            }
+    size_t i = segregated_free_list_lower_bound(alloc_size);
+    free_list_t *list = &heap->free_lists[i];
+    for (free_node_t *fp = free_node_first(list); fp != NULL;
+         fp = free_node_next(list, fp)) {
+        profile_step();
+        if (get_size(header_ptr(fp)) >= alloc_size) {
+            return fp;
         }
     }
+    // every block in a larger class fits
+    if ((i = segregated_free_list_next_nonempty(i)) < SEGREGATED_NUM_LISTS) {
+        profile_step();
+        return free_node_first(&heap->free_lists[i]);
+    }
     return NULL;
 }
 
 static inline void *segregated_find_best_fit(size_t alloc_size) {
     for (size_t i = segregated_free_list_lower_bound(alloc_size);
-         i < SEGREGATED_NUM_LISTS; i++) {
-        list_node_t *list = &segregated_free_lists[i];
+         i < SEGREGATED_NUM_LISTS;
+         i = segregated_free_list_next_nonempty(i)) {
+        free_list_t *list = &heap->free_lists[i];
         void *best_bp = NULL;
         size_t best_size = SIZE_MAX;
-        for (list_node_t *fp = list_begin(list); fp != list_end(list);
-             fp = fp->next) {
+        for (free_node_t *fp = free_node_first(list); fp != NULL;
+             fp = free_node_next(list, fp)) {
+            profile_step();
             size_t block_size = get_size(header_ptr(fp));
             if (block_size >= alloc_size && block_size < best_size) {
                 best_bp = fp;
@@ -467,13 +1223,52 @@ static inline void *segregated_find_best_fit(size_t alloc_size) {
     return NULL;
 }
 
+/*
+ * Largest free block of lo to hi bytes, 0 if none. Only the highest non-empty
+ * lists in the range need a look, and a small list holds a single size.
+ */
+static inline size_t segregated_find_largest(size_t lo, size_t hi) {
+    if (hi < SEGREGATED_MIN_BLOCK_SIZE) {
+        return 0;
+    }
+    size_t first = segregated_free_list_lower_bound(
+        MAX(lo, SEGREGATED_MIN_BLOCK_SIZE));
+    size_t last = segregated_free_list_lower_bound(hi);
+    uint64_t mask = heap->free_lists_bitmap >> first << first;
+    if (last < 63) {
+        mask &= ((uint64_t)2 << last) - 1;
+    }
+    for (; mask != 0; mask &= ~((uint64_t)1 << (63 - __builtin_clzll(mask)))) {
+        size_t i = 63 - __builtin_clzll(mask);
+        if (i < segregated_num_small_lists()) {
+            return segregated_free_list_min_size(i);
+        }
+        // the last list is unbounded and may hold larger blocks
+        size_t largest = 0;
+        free_list_t *list = &heap->free_lists[i];
+        for (free_node_t *fp = free_node_first(list); fp != NULL;
+             fp = free_node_next(list, fp)) {
+            size_t size = get_size(header_ptr(fp));
+            if (lo <= size && size <= hi) {
+                largest = MAX(largest, size);
+            }
+        }
+        if (largest > 0) {
+            return largest;
+        }
+    }
+    return 0;
+}
+
 #define MIN_BLOCK_SIZE SEGREGATED_MIN_BLOCK_SIZE
 #define free_list_init segregated_free_list_init
 #define free_list_insert segregated_free_list_insert
 #define free_list_erase segregated_free_list_erase
-#define free_list_update segregated_free_list_update
 #define do_mm_print segregated_mm_print
 #define do_mm_check segregated_mm_check
+#define do_mm_check_sample segregated_mm_check_sample
+#define free_list_contains segregated_free_list_contains
+#define find_largest segregated_find_largest
 
 #if defined(MM_FIRST_FIT)
 #define find_fit segregated_find_first_fit
@@ -483,26 +1278,357 @@ static inline void *segregated_find_best_fit(size_t alloc_size) {
 #error "must define either MM_FIRST_FIT or MM_BEST_FIT"
 #endif
 
-#else
-#error "must define one of MM_IMPLICIT, MM_EXPLICIT or MM_SEGREGATED"
-#endif
+#elif defined(MM_TREE)
+/*
+ * Memory malloc using a splay tree of free blocks.
+ *
+ * Free blocks are the nodes of a single binary search tree keyed by block size
+ * and then by address, with the left and right child pointers stored in the
+ * payload like the links of an explicit free list. The tree is a top-down
+ * splay tree, so it needs no balance information and recently used sizes stay
+ * near the root. A lookup for the smallest key that is not less than
+ * (alloc_size, NULL) yields the best fit, breaking ties by the lowest address.
+ * Since there is no cheaper way to find a first fit, both placement strategies
+ * use this lookup.
+ */
 
-static void place(void *bp, size_t alloc_size) {
-    free_list_erase(bp);
-    size_t block_size = get_size(header_ptr(bp));
-    if (block_size < alloc_size + MIN_BLOCK_SIZE) {
-        set_meta(header_ptr(bp), block_size, 1, 1);
-        set_prev_alloc(header_ptr(next_block(bp)), 1);
-    } else {
-        // splitting
-        set_meta(header_ptr(bp), alloc_size, 1, 1);
-        void *next_bp = next_block(bp);
-        set_meta(header_ptr(next_bp), block_size - alloc_size, 1, 0);
-        sync_footer(next_bp);
-        free_list_insert(next_bp);
+#define TREE_MIN_BLOCK_SIZE ALIGN(2 * WSIZE + 2 * sizeof(tree_node_t *))
+
+static inline void tree_free_list_init() { heap->free_tree = NULL; }
+static inline void tree_free_list_insert(void *bp) {
+    tree_insert(&heap->free_tree, bp);
+}
+static inline void tree_free_list_erase(void *bp) {
+    tree_erase(&heap->free_tree, bp);
+}
+
+static void tree_mm_print_node(tree_node_t *node) {
+    if (node == NULL) {
+        return;
+    }
+    tree_mm_print_node(node->left);
+    printf("[%d/%d/%d %p] -> ", get_size(header_ptr(node)),
+           get_prev_alloc(header_ptr(node)), get_alloc(header_ptr(node)),
+           (void *)node);
+    tree_mm_print_node(node->right);
+}
+
+static inline void tree_mm_print() {
+    mm_print_heap();
+
+    printf("  FREE: ");
+    tree_mm_print_node(heap->free_tree);
+    printf("NULL\n");
+}
+
+/*
+ * Checks that the subtree lies strictly between lo and hi, visiting at most
+ * *budget nodes in preorder, and returns the number of nodes visited
+ */
+static size_t tree_mm_check_node(tree_node_t *node, tree_node_t *lo,
+                                 tree_node_t *hi, size_t *budget) {
+    if (node == NULL || *budget == 0) {
+        return 0;
+    }
+    (*budget)--;
+    size_t size = get_size(header_ptr(node));
+    assert(!get_alloc(header_ptr(node)) &&
+           "blocks in free tree must be unallocated");
+    assert((lo == NULL || tree_compare(size, node, lo) > 0) &&
+           (hi == NULL || tree_compare(size, node, hi) < 0) &&
+           "free tree out of order");
+    size_t left = tree_mm_check_node(node->left, lo, node, budget);
+    return 1 + left + tree_mm_check_node(node->right, node, hi, budget);
+}
+
+static inline void tree_mm_check() {
+    mm_check_heap(TREE_MIN_BLOCK_SIZE);
+
+    size_t num_free = 0;
+    for (void *bp = heap->block_head; bp != heap->block_tail;
+         bp = next_block(bp)) {
+        num_free += !get_alloc(header_ptr(bp));
+    }
+    size_t budget = SIZE_MAX;
+    assert(tree_mm_check_node(heap->free_tree, NULL, NULL, &budget) ==
+               num_free &&
+           "free tree and heap disagree on free blocks");
+}
+// splaying keeps the recently used blocks near the root, where this looks
+static inline void tree_mm_check_sample(size_t round, size_t window) {
+    tree_mm_check_node(heap->free_tree, NULL, NULL, &window);
+}
+static inline int tree_free_list_contains(void *bp) {
+    size_t size = get_size(header_ptr(bp));
+    tree_node_t *t = heap->free_tree;
+    int cmp;
+    while (t != NULL && (cmp = tree_compare(size, bp, t)) != 0) {
+        t = cmp < 0 ? t->left : t->right;
+    }
+    return t != NULL;
+}
+
+static inline void *tree_find_best_fit(size_t alloc_size) {
+#ifdef MM_PROFILE
+    // the splay walks down the search path, so count its length first
+    for (tree_node_t *t = heap->free_tree; t != NULL;
+         t = tree_compare(alloc_size, NULL, t) < 0 ? t->left : t->right) {
+        profile_step();
+    }
+#endif
+    return tree_lower_bound(&heap->free_tree, alloc_size);
+}
+
+/*
+ * Largest free block of lo to hi bytes, 0 if none, found on one search path
+ * without splaying
+ */
+static inline size_t tree_find_largest(size_t lo, size_t hi) {
+    size_t largest = 0;
+    for (tree_node_t *t = heap->free_tree; t != NULL;) {
+        size_t size = get_size(header_ptr(t));
+        if (size <= hi) {
+            largest = size;
+            t = t->right;
+        } else {
+            t = t->left;
+        }
+    }
+    return largest >= lo ? largest : 0;
+}
+
+#define MIN_BLOCK_SIZE TREE_MIN_BLOCK_SIZE
+#define free_list_init tree_free_list_init
+#define free_list_insert tree_free_list_insert
+#define free_list_erase tree_free_list_erase
+#define do_mm_print tree_mm_print
+#define do_mm_check tree_mm_check
+#define do_mm_check_sample tree_mm_check_sample
+#define free_list_contains tree_free_list_contains
+#define find_largest tree_find_largest
+#define find_fit tree_find_best_fit
+
+#else
+#error "must define one of MM_IMPLICIT, MM_EXPLICIT, MM_SEGREGATED or MM_TREE"
+#endif
+
+// block sizes, and so payloads, stay aligned only if the minimum is
+_Static_assert(MIN_BLOCK_SIZE % MM_ALIGNMENT == 0,
+               "minimum block size must be a multiple of MM_ALIGNMENT");
+
+/*
+ * Free blocks enter and leave the free list through these, which keep the
+ * free block counters of the heap in step.
+ */
+static inline void link_free_block(void *bp) {
+    size_t size = get_size(header_ptr(bp));
+    size_t cls = stats_class(size);
+    stats_set(free_bytes, heap->stats.free_bytes + size);
+    stats_set(free_blocks[cls], heap->stats.free_blocks[cls] + 1);
+    stats_set(free_class_bytes[cls], heap->stats.free_class_bytes[cls] + size);
+    if (size > heap->stats.free_class_max[cls]) {
+        stats_set(free_class_max[cls], size);
+        heap->stats.stale_classes &= ~((uint32_t)1 << cls);
+    }
+    if (size > heap->stats.largest_free) {
+        stats_set(largest_free, size);
+    }
+    free_list_insert(bp);
+}
+static inline void unlink_free_block(void *bp) {
+    size_t size = get_size(header_ptr(bp));
+    size_t cls = stats_class(size);
+    stats_set(free_bytes, heap->stats.free_bytes - size);
+    stats_set(free_blocks[cls], heap->stats.free_blocks[cls] - 1);
+    stats_set(free_class_bytes[cls], heap->stats.free_class_bytes[cls] - size);
+    if (heap->stats.free_blocks[cls] == 0) {
+        stats_set(free_class_max[cls], 0);
+        heap->stats.stale_classes &= ~((uint32_t)1 << cls);
+    } else if (size == heap->stats.free_class_max[cls]) {
+        heap->stats.stale_classes |= (uint32_t)1 << cls;
+    }
+    if (size == heap->stats.largest_free) {
+        heap->stats.stale_largest = 1;
+    }
+    free_list_erase(bp);
+}
+
+/*
+ * Looks up the largest free block of the heap once the heap is consistent
+ * again, after the previous one has left the free list
+ */
+static void stats_refresh() {
+    size_t cls = MM_STATS_CLASSES;
+    while (cls > 0 && heap->stats.free_blocks[cls - 1] == 0) {
+        cls--;
+    }
+    if (cls-- == 0) {
+        stats_set(largest_free, 0);
+    } else {
+        if ((heap->stats.stale_classes >> cls) & 1) {
+            stats_set(free_class_max[cls],
+                      find_largest((size_t)1 << cls, stats_class_max(cls)));
+            heap->stats.stale_classes &= ~((uint32_t)1 << cls);
+        }
+        stats_set(largest_free, heap->stats.free_class_max[cls]);
+    }
+    heap->stats.stale_largest = 0;
+}
+
+#ifdef MM_PROFILE
+/*
+ * Allocations from the heap are counted by the free list class of the block
+ * size, where find_fit starts looking, and by the bucket of the bytes
+ * requested, or of the payload for blocks the package allocates for itself.
+ * Frees are counted by the class and the payload of the freed block.
+ */
+static inline size_t profile_class(size_t block_size) {
+#ifdef MM_SEGREGATED
+    return segregated_free_list_lower_bound(block_size);
+#else
+    return stats_class(block_size);
+#endif
+}
+static inline size_t profile_walk_bucket(size_t steps) {
+    size_t bucket = steps ? 8 * sizeof(unsigned long) - __builtin_clzl(steps)
+                          : 0;
+    return MIN(bucket, PROFILE_NUM_WALKS - 1);
+}
+
+/* Remembers the bytes requested by the caller of the next allocation */
+static inline void profile_request(size_t size) {
+    heap->profile.request = size;
+}
+static inline void profile_begin() { heap->profile.steps = 0; }
+
+/*
+ * Counts an allocation of alloc_size bytes, which is served by the block bp,
+ * and was a hit if bp was free before the heap had to grow
+ */
+static void profile_alloc(size_t alloc_size, void *bp, int hit) {
+    size_t request = heap->profile.request ? heap->profile.request
+                                           : alloc_size - WSIZE;
+    profile_row_t *rows[] = {
+        &heap->profile.classes[profile_class(alloc_size)],
+        &heap->profile.requests[stats_class(request)]};
+    int split = bp != NULL &&
+                get_size(header_ptr(bp)) >= alloc_size + MIN_BLOCK_SIZE;
+    size_t walk = profile_walk_bucket(heap->profile.steps);
+    for (size_t i = 0; i < sizeof(rows) / sizeof(rows[0]); i++) {
+        rows[i]->mallocs++;
+        rows[i]->hits += hit;
+        rows[i]->misses += !hit;
+        rows[i]->splits += split;
+        rows[i]->walked += heap->profile.steps;
+        rows[i]->walks[walk]++;
+    }
+    heap->profile.request = 0;
+}
+static void profile_free(void *bp) {
+    size_t size = get_size(header_ptr(bp));
+    heap->profile.classes[profile_class(size)].frees++;
+    heap->profile.requests[stats_class(size - WSIZE)].frees++;
+}
+#else
+static inline void profile_request(size_t size) {}
+static inline void profile_begin() {}
+static inline void profile_alloc(size_t alloc_size, void *bp, int hit) {}
+static inline void profile_free(void *bp) {}
+#endif
+
+#ifdef MM_CHECK_INCREMENTAL
+/* Remembers a block changed by the current request for mm_check */
+static inline void check_touch(void *bp) {
+    for (size_t i = 0; i < CHECK_NUM_TOUCHED; i++) {
+        if (heap->check_touched[i] == NULL || heap->check_touched[i] == bp) {
+            heap->check_touched[i] = bp;
+            return;
+        }
+    }
+}
+/*
+ * Called when the block gone is merged into the block into, or is cut off the
+ * heap if into is NULL, so that mm_check never looks at a stale block
+ */
+static inline void check_forget(void *gone, void *into) {
+    for (size_t i = 0; i < CHECK_NUM_TOUCHED; i++) {
+        if (heap->check_touched[i] == gone) {
+            heap->check_touched[i] = into;
+        }
+    }
+    if (heap->check_cursor == gone) {
+        heap->check_cursor = into;
+    }
+}
+#else
+static inline void check_touch(void *bp) {}
+static inline void check_forget(void *gone, void *into) {}
+#endif
+
+/*
+ * Fresh memory. The bytes from heap->fresh up to the footer of the last block
+ * have never been written since memlib handed them out, so they read as zeros.
+ * Only the last block may reach past heap->fresh, and only while it is free,
+ * since allocated blocks claim the memory up to their end and room for the
+ * links of a free block split off after them.
+ */
+static inline void fresh_claim(void *bp) {
+    char *end = (char *)next_block(bp) + MIN_BLOCK_SIZE;
+    if (end > (char *)heap->fresh) {
+        heap->fresh = end;
     }
 }
 
+/*
+ * Moves heap->fresh after extend_heap grew the heap from old_tail on, with the
+ * memory from zero on read as zeros, and coalesced the new block into bp.
+ */
+static void fresh_extend(void *old_tail, void *bp, char *zero) {
+    char *old_end = (char *)old_tail - 2 * WSIZE;
+    if (bp != old_tail && zero == (char *)old_tail &&
+        (char *)heap->fresh <= old_end) {
+        // the fresh memory goes on past the old footer and tail header
+        memset(old_end, 0, 2 * WSIZE);
+    } else if (bp != old_tail) {
+        heap->fresh = zero;
+    } else {
+        // the links of the new block are written past the old tail
+        heap->fresh = MAX(zero, (char *)old_tail + MIN_BLOCK_SIZE);
+    }
+}
+
+static void place(void *bp, size_t alloc_size) {
+    unlink_free_block(bp);
+    check_touch(bp);
+    size_t block_size = get_size(header_ptr(bp));
+    // where the payload starts to read as zeros, for calloc
+    heap->placed = bp;
+    heap->placed_zero = MAX((char *)bp, (char *)heap->fresh);
+    if (block_size < alloc_size + MIN_BLOCK_SIZE) {
+        if ((char *)footer_ptr(bp) >= (char *)heap->placed_zero) {
+            *(word_t *)footer_ptr(bp) = 0;
+        }
+        set_meta(header_ptr(bp), block_size, 1, 1);
+        set_prev_alloc(header_ptr(next_block(bp)), 1);
+    } else {
+        // splitting
+        stats_set(splits, heap->stats.splits + 1);
+        set_meta(header_ptr(bp), alloc_size, 1, 1);
+        void *next_bp = next_block(bp);
+        set_meta(header_ptr(next_bp), block_size - alloc_size, 1, 0);
+        sync_footer(next_bp);
+        link_free_block(next_bp);
+        check_touch(next_bp);
+    }
+    fresh_claim(bp);
+}
+
+/*
+ * Merges the free block bp, which is not in any free list yet, with its free
+ * neighbors and inserts the result into the free list. Neighbors are erased
+ * from the free list before their headers change, so that free lists keyed by
+ * block size can still locate them.
+ */
 static void *coalesce(void *bp) {
     size_t size = get_size(header_ptr(bp));
 
@@ -515,193 +1641,1671 @@ static void *coalesce(void *bp) {
     if (!prev_alloc) {
         void *prev_bp = prev_block(bp);
         size_t prev_size = get_size(prev_footer_ptr(bp));
+        unlink_free_block(prev_bp);
+        stats_set(coalesces, heap->stats.coalesces + 1);
+        check_forget(bp, prev_bp);
         if (!next_alloc) {
             // coalesce previous & next blocks
+            unlink_free_block(next_bp);
+            stats_set(coalesces, heap->stats.coalesces + 1);
+            check_forget(next_bp, prev_bp);
             set_meta(header_ptr(prev_bp), prev_size + size + next_size, 1, 0);
             sync_footer(prev_bp);
-            free_list_erase(bp);
-            free_list_erase(next_bp);
         } else {
             // coalesce previous block
             set_meta(header_ptr(prev_bp), prev_size + size, 1, 0);
             sync_footer(prev_bp);
-            free_list_erase(bp);
         }
         bp = prev_bp;
     } else {
         if (!next_alloc) {
             // coalesce next block
+            unlink_free_block(next_bp);
+            stats_set(coalesces, heap->stats.coalesces + 1);
+            check_forget(next_bp, bp);
             set_meta(header_ptr(bp), size + next_size, 1, 0);
             sync_footer(bp);
-            free_list_erase(next_bp);
         }
     }
-    // block size may have changed, update the block location in free list
-    free_list_update(bp);
+    link_free_block(bp);
+    check_touch(bp);
     return bp;
 }
 
 static void *extend_heap(size_t size) {
+    if (size > INT_MAX - ALIGNMENT) {
+        // more than mem_sbrk can grow the heap by at once
+        return NULL;
+    }
     size = MAX(align(size), MIN_BLOCK_SIZE);
+#ifdef MM_CHUNK_SIZE
+    // grow up to the next chunk boundary, unless that is too far for sbrk
+    uintptr_t end = ((uintptr_t)heap->block_tail + size + MM_CHUNK_SIZE - 1) &
+                    ~(uintptr_t)(MM_CHUNK_SIZE - 1);
+    if (end - (uintptr_t)heap->block_tail <= INT_MAX) {
+        size = end - (uintptr_t)heap->block_tail;
+    }
+#endif
+#ifdef MM_COMPACT
+    // links must stay within 4 GB of heap_base
+    if ((char *)heap->block_tail + size - heap_base > UINT32_MAX) {
+        return NULL;
+    }
+#endif
+    char *zero = MAX((char *)heap->block_tail, (char *)heap_fresh());
     void *old_tail;
-    if ((old_tail = mem_sbrk(size)) == (void *)-1) {
+    if ((old_tail = heap_sbrk(size)) == (void *)-1) {
         return NULL;
     }
-    block_tail = (char *)old_tail + size;
+    heap->block_tail = (char *)old_tail + size;
+    stats_set(extends, heap->stats.extends + 1);
+    stats_set(heap_bytes, heap->stats.heap_bytes + size);
     size_t prev_alloc = get_prev_alloc(header_ptr(old_tail));
     set_meta(header_ptr(old_tail), size, prev_alloc, 0);
     sync_footer(old_tail);
-    free_list_insert(old_tail);
-    set_meta(header_ptr(block_tail), 0, 0, 1);
-    return coalesce(old_tail);
+    set_meta(header_ptr(heap->block_tail), 0, 0, 1);
+    void *bp = coalesce(old_tail);
+    fresh_extend(old_tail, bp, zero);
+    return bp;
 }
 
-static int do_mm_init(void) {
-    free_list_init();
-    if ((block_head = mem_sbrk(4 * sizeof(size_t))) == (void *)-1) {
-        return -1;
+#ifdef MM_TRIM
+/*
+ * Gives the memory of a large free block back to the system. The block at the
+ * end of the heap is cut off by lowering the brk, while only the pages between
+ * the free list links and the footer of other blocks can be released. Of
+ * those, the pages outside [lo, hi) were released before.
+ */
+static void release_block(void *bp, char *lo, char *hi) {
+    size_t size = get_size(header_ptr(bp));
+    if (next_block(bp) == heap->block_tail) {
+        void *new_tail = bp;
+#ifdef MM_CHUNK_SIZE
+        // keep the end of the heap on a chunk boundary
+        uintptr_t end = ((uintptr_t)bp + MM_CHUNK_SIZE - 1) &
+                        ~(uintptr_t)(MM_CHUNK_SIZE - 1);
+        if (end != (uintptr_t)bp && end - (uintptr_t)bp < MIN_BLOCK_SIZE) {
+            end += MM_CHUNK_SIZE;
+        }
+        new_tail = (void *)end;
+#endif
+        size_t trim_size = (char *)heap->block_tail - (char *)new_tail;
+        if ((char *)new_tail < (char *)heap->block_tail &&
+            trim_size >= MM_TRIM_THRESHOLD) {
+            unlink_free_block(bp);
+            if (new_tail == bp) {
+                check_forget(bp, NULL);
+            } else {
+                // the part of the block below the chunk boundary stays free
+                set_size(header_ptr(bp), size - trim_size);
+                sync_footer(bp);
+                link_free_block(bp);
+            }
+            // mem_sbrk takes an int, so lower the brk in steps it can take
+            for (size_t left = trim_size; left > 0;) {
+                size_t step = MIN(left, (size_t)INT_MAX & ~(ALIGNMENT - 1));
+                heap_sbrk(-(int)step);
+                left -= step;
+            }
+            heap->block_tail = new_tail;
+            stats_set(heap_bytes, heap->stats.heap_bytes - trim_size);
+            set_meta(header_ptr(heap->block_tail), 0, new_tail == bp, 1);
+        }
+    } else if (size >= MM_RELEASE_THRESHOLD) {
+        // widen [lo, hi) to the pages it touches, which were kept before
+        uintptr_t page_mask = mem_pagesize() - 1;
+        lo = MAX((char *)bp + MIN_BLOCK_SIZE - 2 * WSIZE,
+                 (char *)((uintptr_t)lo & ~page_mask));
+        hi = MIN((char *)bp + size - 2 * WSIZE,
+                 (char *)(((uintptr_t)hi + page_mask) & ~page_mask));
+        if (lo < hi) {
+            mem_release(lo, hi - lo);
+        }
     }
-    block_head = (char *)block_head + 2 * sizeof(size_t);
-    block_tail = (char *)block_head + 2 * sizeof(size_t);
-    set_meta(header_ptr(block_head), 2 * sizeof(size_t), 1, 1);
-    set_meta(header_ptr(block_tail), 0, 1, 1);
-    return 0;
 }
+#endif
 
-static void *do_mm_malloc(size_t size) {
-    if (size == 0) {
+static void free_block(void *bp) {
+    assert(get_alloc(header_ptr(bp)) && "double free or corruption");
+    set_alloc(header_ptr(bp), 0);
+    set_grown(header_ptr(bp), 0);
+    sync_footer(bp);
+    set_prev_alloc(header_ptr(next_block(bp)), 0);
+#ifdef MM_TRIM
+    // free neighbors too small to be released still hold all their pages
+    char *lo = (char *)prev_footer_ptr(bp);
+    char *hi = (char *)next_block(bp) + MIN_BLOCK_SIZE - 2 * WSIZE;
+    if (!get_prev_alloc(header_ptr(bp)) &&
+        get_size(prev_footer_ptr(bp)) < MM_RELEASE_THRESHOLD) {
+        lo = (char *)prev_block(bp);
+    }
+    void *next_bp = next_block(bp);
+    if (!get_alloc(header_ptr(next_bp)) &&
+        get_size(header_ptr(next_bp)) < MM_RELEASE_THRESHOLD) {
+        hi = (char *)next_block(next_bp);
+    }
+#endif
+    bp = coalesce(bp);
+#ifdef MM_TRIM
+    release_block(bp, lo, hi);
+#endif
+}
+
+#ifdef MM_DEFERRED_COALESCING
+/*
+ * Deferred coalescing.
+ *
+ * Freed blocks of at most QUICK_MAX_SIZE bytes are parked in quick lists, one
+ * singly linked list per exact block size, linked through their payloads. A
+ * parked block stays marked as allocated, so it is neither coalesced nor
+ * visible to find_fit, and a request of the same size takes it back without
+ * splitting. All parked blocks are freed and coalesced at once when find_fit
+ * misses, or when more than QUICK_MAX_BYTES are parked.
+ *
+ * The headers have no bit to spare for telling a parked block from a live one,
+ * so a parked block with room for it carries a mark after its link instead.
+ * Freeing a marked block again is caught by looking for it in its quick list.
+ */
+
+static const size_t QUICK_MAX_BYTES = 64 * 1024;
+
+static inline size_t quick_max_size() {
+    return MIN_BLOCK_SIZE + (QUICK_NUM_LISTS - 1) * ALIGNMENT;
+}
+static inline size_t quick_index(size_t block_size) {
+    return (block_size - MIN_BLOCK_SIZE) / ALIGNMENT;
+}
+
+// the mark of parked blocks, after their quick list link
+static inline int quick_has_mark(size_t block_size) {
+    return block_size - WSIZE >= 2 * sizeof(void *);
+}
+static inline void **quick_mark(void *bp) { return (void **)bp + 1; }
+
+static void quick_init() {
+    memset(heap->quick_lists, 0, sizeof(heap->quick_lists));
+    heap->quick_bytes = 0;
+}
+
+static void quick_flush() {
+    for (size_t i = 0; i < QUICK_NUM_LISTS; i++) {
+        while (heap->quick_lists[i] != NULL) {
+            void *bp = heap->quick_lists[i];
+            heap->quick_lists[i] = *(void **)bp;
+            if (quick_has_mark(get_size(header_ptr(bp)))) {
+                *quick_mark(bp) = NULL;
+            }
+            free_block(bp);
+        }
+    }
+    heap->quick_bytes = 0;
+}
+
+static inline int quick_push(void *bp) {
+    size_t block_size = get_size(header_ptr(bp));
+    if (block_size > quick_max_size()) {
+        return 0;
+    }
+    size_t idx = quick_index(block_size);
+    // parked blocks look allocated, so free_block cannot catch a repeat free
+    if (quick_has_mark(block_size)) {
+        if (*quick_mark(bp) == heap->quick_lists) {
+            // parked, or live data that happens to look like the mark
+            for (void *p = heap->quick_lists[idx]; p != NULL; p = *(void **)p) {
+                assert(p != bp && "double free or corruption");
+            }
+        }
+        *quick_mark(bp) = heap->quick_lists;
+    } else {
+        // too small for the mark, catch at least freeing the last parked again
+        assert(bp != heap->quick_lists[idx] && "double free or corruption");
+    }
+    *(void **)bp = heap->quick_lists[idx];
+    heap->quick_lists[idx] = bp;
+    if ((heap->quick_bytes += block_size) > QUICK_MAX_BYTES) {
+        quick_flush();
+    }
+    return 1;
+}
+
+static inline void *quick_pop(size_t alloc_size) {
+    if (alloc_size > quick_max_size()) {
         return NULL;
     }
-    size_t alloc_size = MAX(align(size + sizeof(size_t)), MIN_BLOCK_SIZE);
+    size_t idx = quick_index(alloc_size);
+    void *bp = heap->quick_lists[idx];
+    if (bp != NULL) {
+        heap->quick_lists[idx] = *(void **)bp;
+        heap->quick_bytes -= alloc_size;
+        if (quick_has_mark(alloc_size)) {
+            *quick_mark(bp) = NULL;
+        }
+    }
+    return bp;
+}
+
+static void quick_mm_check() {
+    size_t bytes = 0;
+    for (size_t i = 0; i < QUICK_NUM_LISTS; i++) {
+        for (void *bp = heap->quick_lists[i]; bp != NULL; bp = *(void **)bp) {
+            assert(get_alloc(header_ptr(bp)) &&
+                   "blocks in quick list must stay allocated");
+            assert(quick_index(get_size(header_ptr(bp))) == i &&
+                   "block in wrong quick list");
+            assert((!quick_has_mark(get_size(header_ptr(bp))) ||
+                    *quick_mark(bp) == heap->quick_lists) &&
+                   "parked block lost its mark");
+            bytes += get_size(header_ptr(bp));
+            // a block parked twice links the list into a cycle
+            assert(bytes <= heap->quick_bytes && "corrupted quick lists");
+        }
+    }
+    assert(bytes == heap->quick_bytes && "corrupted quick lists");
+}
+#endif
 
+static void *alloc_block(size_t alloc_size) {
     void *bp;
+    profile_begin();
+#ifdef MM_DEFERRED_COALESCING
+    if ((bp = quick_pop(alloc_size)) != NULL) {
+        check_touch(bp);
+        profile_alloc(alloc_size, bp, 1);
+        return bp;
+    }
+#endif
     if ((bp = find_fit(alloc_size)) != NULL) {
+        profile_alloc(alloc_size, bp, 1);
         place(bp, alloc_size);
         return bp;
     }
+#ifdef MM_DEFERRED_COALESCING
+    if (heap->quick_bytes) {
+        // coalesce the parked blocks and try again before growing the heap
+        quick_flush();
+        if ((bp = find_fit(alloc_size)) != NULL) {
+            profile_alloc(alloc_size, bp, 1);
+            place(bp, alloc_size);
+            return bp;
+        }
+    }
+#endif
 
     size_t extend_size = alloc_size;
-    if (!get_prev_alloc(header_ptr(block_tail))) {
-        extend_size -= get_size(prev_footer_ptr(block_tail));
+    if (!get_prev_alloc(header_ptr(heap->block_tail))) {
+        extend_size -= get_size(prev_footer_ptr(heap->block_tail));
     }
 
-    if ((bp = extend_heap(extend_size)) == NULL) {
+    bp = extend_heap(extend_size);
+    profile_alloc(alloc_size, bp, 0);
+    if (bp == NULL) {
         return NULL;
     }
     place(bp, alloc_size);
     return bp;
 }
 
-static void do_mm_free(void *ptr) {
-    if (ptr == NULL) {
-        return;
+/* Splits off and frees the tail of an allocated block beyond alloc_size */
+static void shrink_block(void *bp, size_t alloc_size) {
+    size_t block_size = get_size(header_ptr(bp));
+    if (alloc_size + MIN_BLOCK_SIZE <= block_size) {
+        stats_set(splits, heap->stats.splits + 1);
+        check_touch(bp);
+        set_size(header_ptr(bp), alloc_size);
+        void *next_bp = next_block(bp);
+        set_meta(header_ptr(next_bp), block_size - alloc_size, 1, 1);
+        free_block(next_bp);
     }
-    assert(get_alloc(header_ptr(ptr)) && "double free or corruption");
-    set_alloc(header_ptr(ptr), 0);
-    sync_footer(ptr);
-    free_list_insert(ptr);
-    set_prev_alloc(header_ptr(next_block(ptr)), 0);
-    coalesce(ptr);
 }
 
-static void *do_mm_realloc(void *ptr, size_t size) {
-    if (ptr == NULL) {
-        return do_mm_malloc(size);
+/*
+ * Allocates a block whose payload is aligned to alignment, a power of two. The
+ * block is carved out of a larger one, whose leading slack becomes a free
+ * block of its own and whose trailing slack is shrunk off.
+ */
+static void *alloc_aligned_block(size_t alignment, size_t alloc_size) {
+    if (alignment <= ALIGNMENT) {
+        return alloc_block(alloc_size);
     }
-    if (size == 0) {
-        do_mm_free(ptr);
+    void *bp;
+    if ((bp = alloc_block(alloc_size + alignment + MIN_BLOCK_SIZE)) == NULL) {
         return NULL;
     }
-    size_t old_size = get_size(header_ptr(ptr)) - sizeof(size_t);
-
-    size_t alloc_size = MAX(align(size + sizeof(size_t)), MIN_BLOCK_SIZE);
-
-    void *next_bp = next_block(ptr);
-    if (next_bp == block_tail || (!get_alloc(header_ptr(next_bp)) &&
-                                  next_block(next_bp) == block_tail)) {
-        // extend heap if needed
-        size_t merged_size =
-            get_size(header_ptr(ptr)) + get_size(header_ptr(next_bp));
-        if (merged_size < alloc_size) {
-            if (extend_heap(alloc_size - merged_size) == NULL) {
-                return NULL;
-            }
+    uintptr_t addr = ((uintptr_t)bp + alignment - 1) & ~(alignment - 1);
+    if (addr != (uintptr_t)bp) {
+        // the leading slack must be large enough for a free block
+        while (addr - (uintptr_t)bp < MIN_BLOCK_SIZE) {
+            addr += alignment;
         }
+        size_t block_size = get_size(header_ptr(bp));
+        size_t lead_size = addr - (uintptr_t)bp;
+        void *aligned_bp = (void *)addr;
+        stats_set(splits, heap->stats.splits + 1);
+        set_size(header_ptr(bp), lead_size);
+        set_meta(header_ptr(aligned_bp), block_size - lead_size, 1, 1);
+        free_block(bp);
+        bp = aligned_bp;
     }
+    shrink_block(bp, alloc_size);
+    return bp;
+}
 
-    if (!get_alloc(header_ptr(next_bp))) {
-        // merge next free block
-        free_list_erase(next_bp);
-        set_size(header_ptr(ptr),
-                 get_size(header_ptr(ptr)) + get_size(header_ptr(next_bp)));
-        set_prev_alloc(header_ptr(next_block(ptr)), 1);
-    }
+#ifdef MM_MMAP
+/*
+ * Direct mapping of huge requests.
+ *
+ * Requests of at least MM_MMAP_THRESHOLD bytes are served by a memlib mapping
+ * of their own instead of the heap, so that a huge block never fragments the
+ * heap and its memory goes back to the system as soon as it is freed. Each
+ * mapping starts with an mmap_chunk_t that links it into the global list of
+ * mapped chunks. It ends with a block header right before the payload, so
+ * that get_size works on mapped payloads as well.
+ *
+ * Heap blocks always lie inside a memlib region, so any payload outside of
+ * them is a mapped chunk. Mapped chunks belong to no arena, and the list has
+ * a lock of its own that is only taken while holding a heap lock.
+ */
 
-    size_t this_size = get_size(header_ptr(ptr));
-    if (alloc_size <= this_size) {
-        // in-place realloc
-        if (alloc_size + MIN_BLOCK_SIZE <= this_size) {
-            // shrink to fit
-            set_size(header_ptr(ptr), alloc_size);
-            void *next_bp = next_block(ptr);
-            set_meta(header_ptr(next_bp), this_size - alloc_size, 1, 1);
-            do_mm_free(next_bp);
-        }
-        return ptr;
-    }
+typedef struct {
+    list_node_t node;
+    size_t map_size;
+    size_t header; // a word_t at its end
+} mmap_chunk_t;
 
-    void *new_ptr;
-    if ((new_ptr = do_mm_malloc(size)) == NULL) {
-        return NULL;
-    }
-    memcpy(new_ptr, ptr, MIN(size, old_size));
-    do_mm_free(ptr);
-    return new_ptr;
-}
+static list_node_t mmap_chunks;
+static size_t mmap_bytes; // written under the list lock, read by mm_stats
+#ifdef MM_THREAD_SAFE
+static pthread_mutex_t mmap_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
-int mm_init(void) {
-    int ret = do_mm_init();
-#ifdef MM_CHECK
-    do_mm_check();
+static inline void mmap_list_lock() {
+#ifdef MM_THREAD_SAFE
+    pthread_mutex_lock(&mmap_lock);
 #endif
-#ifdef MM_VERBOSE
-    printf("\nINIT:\n");
-    do_mm_print();
+}
+static inline void mmap_list_unlock() {
+#ifdef MM_THREAD_SAFE
+    pthread_mutex_unlock(&mmap_lock);
 #endif
-    return ret;
 }
 
-void *mm_malloc(size_t size) {
-    void *ptr = do_mm_malloc(size);
-#ifdef MM_CHECK
-    do_mm_check();
-#endif
-#ifdef MM_VERBOSE
-    printf("MALLOC %d:\n", size);
-    do_mm_print();
-#endif
-    return ptr;
+static inline int mmap_is_mapped(void *ptr) { return mem_arena_of(ptr) < 0; }
+static inline mmap_chunk_t *mmap_chunk_of(void *ptr) {
+    return (mmap_chunk_t *)ptr - 1;
+}
+// leaves room for the aligned block, since mmap_block_size rounds down
+static inline size_t mmap_map_size(size_t size) {
+    size_t pagesize = mem_pagesize();
+    size_t block_size = align(size + WSIZE);
+    return (sizeof(mmap_chunk_t) - WSIZE + block_size + pagesize - 1) &
+           ~(pagesize - 1);
+}
+// the size of the block made of the header and payload of a mapped chunk
+static inline size_t mmap_block_size(size_t map_size) {
+    return (map_size - sizeof(mmap_chunk_t) + WSIZE) & ~(ALIGNMENT - 1);
+}
+static inline void mmap_set_size(mmap_chunk_t *chunk, size_t map_size) {
+    chunk->map_size = map_size;
+    set_meta(header_ptr(chunk + 1), mmap_block_size(map_size), 1, 1);
 }
 
-void mm_free(void *ptr) {
-    do_mm_free(ptr);
-#ifdef MM_CHECK
+// the old chunks are discarded by mem_reset_brk
+static void mmap_init() {
+    list_init(&mmap_chunks);
+    mmap_bytes = 0;
+}
+
+static void *mmap_malloc(size_t size) {
+    if (size > (word_t)-1 / 2) {
+        return NULL;
+    }
+    size_t map_size = mmap_map_size(size);
+    if (map_size > (word_t)-1) {
+        return NULL;
+    }
+    mmap_list_lock();
+    mmap_chunk_t *chunk = mem_map(map_size);
+    if (chunk != (void *)-1) {
+        mmap_set_size(chunk, map_size);
+        list_push_front(&mmap_chunks, &chunk->node);
+        __atomic_store_n(&mmap_bytes, mmap_bytes + map_size, __ATOMIC_RELAXED);
+    }
+    mmap_list_unlock();
+    return chunk != (void *)-1 ? chunk + 1 : NULL;
+}
+
+static void mmap_free(void *ptr) {
+    mmap_chunk_t *chunk = mmap_chunk_of(ptr);
+    assert(get_alloc(header_ptr(ptr)) && "double free or corruption");
+    mmap_list_lock();
+    list_erase(&chunk->node);
+    __atomic_store_n(&mmap_bytes, mmap_bytes - chunk->map_size,
+                     __ATOMIC_RELAXED);
+    mem_unmap(chunk, chunk->map_size);
+    mmap_list_unlock();
+}
+
+/* Resizes a mapped chunk by remapping its pages rather than copying them */
+static void *mmap_realloc(void *ptr, size_t size) {
+    mmap_chunk_t *chunk = mmap_chunk_of(ptr);
+    if (size > (word_t)-1 / 2) {
+        return NULL;
+    }
+    size_t map_size = mmap_map_size(size);
+    if (map_size == chunk->map_size) {
+        return ptr;
+    }
+    if (map_size > (word_t)-1) {
+        return NULL;
+    }
+    mmap_list_lock();
+    // the chunk may move, so unlink it while its neighbors point to it
+    list_erase(&chunk->node);
+    size_t old_map_size = chunk->map_size;
+    mmap_chunk_t *new_chunk = mem_remap(chunk, old_map_size, map_size);
+    if (new_chunk != (void *)-1) {
+        __atomic_store_n(&mmap_bytes, mmap_bytes + map_size - old_map_size,
+                         __ATOMIC_RELAXED);
+        mmap_set_size(new_chunk, map_size);
+        chunk = new_chunk;
+    }
+    list_push_front(&mmap_chunks, &chunk->node);
+    mmap_list_unlock();
+    return new_chunk != (void *)-1 ? new_chunk + 1 : NULL;
+}
+
+static void mmap_mm_check() {
+    mmap_list_lock();
+    for (list_node_t *node = list_begin(&mmap_chunks);
+         node != list_end(&mmap_chunks); node = node->next) {
+        mmap_chunk_t *chunk = (mmap_chunk_t *)node;
+        assert(mmap_is_mapped(chunk + 1) && "mapped chunk inside the heap");
+        assert(get_alloc(header_ptr(chunk + 1)) &&
+               get_size(header_ptr(chunk + 1)) ==
+                   mmap_block_size(chunk->map_size) &&
+               "corrupted mapped chunk");
+        assert(chunk->map_size % mem_pagesize() == 0 &&
+               "mapped chunk size must be page aligned");
+    }
+    mmap_list_unlock();
+}
+#endif
+
+#ifdef MM_SLAB
+/*
+ * Slab allocator for small requests.
+ *
+ * Requests of at most SLAB_MAX_SIZE bytes are rounded up to a multiple of
+ * ALIGNMENT and served from runs of SLAB_RUN_SIZE bytes, each holding objects
+ * of a single size class. Objects carry no header: a run starts with a
+ * slab_run_t holding the object size and a bitmap of free objects, and runs
+ * are allocated as ordinary blocks whose payload is aligned to SLAB_RUN_SIZE.
+ * A per-heap map with one bit per SLAB_RUN_SIZE chunk of the heap region marks
+ * the chunks that hold a run, so an object is recognized, and its run found,
+ * by masking its address. Runs with free objects are kept in a list per size
+ * class, and a run that becomes empty is returned to the block allocator
+ * unless it is the last one of its class. Runs are only placed within the
+ * first SLAB_MAP_CHUNKS chunks of the region, and requests fall back to
+ * ordinary blocks beyond that.
+ */
+
+static const size_t SLAB_MAX_SIZE = SLAB_NUM_CLASSES * ALIGNMENT;
+static const size_t SLAB_RUN_SIZE = (size_t)1 << SLAB_RUN_SHIFT;
+
+typedef struct {
+    list_node_t node;
+    uint32_t obj_size;
+    uint32_t num_objs;
+    uint32_t num_free;
+    uint32_t free_map[SLAB_MAX_OBJS / 32];
+} slab_run_t;
+
+static inline size_t slab_header_size() { return align(sizeof(slab_run_t)); }
+
+static void slab_init(void *heap_lo) {
+    for (size_t i = 0; i < SLAB_NUM_CLASSES; i++) {
+        list_init(&heap->slab_runs[i]);
+    }
+    heap->slab_base = (uintptr_t)heap_lo >> SLAB_RUN_SHIFT;
+    memset(heap->slab_map, 0, sizeof(heap->slab_map));
+}
+
+static inline size_t slab_chunk(heap_t *h, void *ptr) {
+    return ((uintptr_t)ptr >> SLAB_RUN_SHIFT) - h->slab_base;
+}
+
+/* Returns the run holding ptr if ptr is a slab object of heap h, or NULL */
+static inline slab_run_t *slab_run_of(heap_t *h, void *ptr) {
+    size_t chunk = slab_chunk(h, ptr);
+    if (chunk < SLAB_MAP_CHUNKS && (h->slab_map[chunk / 8] >> (chunk % 8) & 1)) {
+        return (slab_run_t *)((uintptr_t)ptr & ~(SLAB_RUN_SIZE - 1));
+    }
+    return NULL;
+}
+
+static slab_run_t *slab_run_create(size_t cls) {
+    slab_run_t *run;
+    // the next block header takes the last word of the chunk
+    if ((run = alloc_aligned_block(SLAB_RUN_SIZE, SLAB_RUN_SIZE)) == NULL) {
+        return NULL;
+    }
+    size_t chunk = slab_chunk(heap, run);
+    if (chunk >= SLAB_MAP_CHUNKS) {
+        free_block(run);
+        return NULL;
+    }
+    heap->slab_map[chunk / 8] |= 1 << (chunk % 8);
+
+    run->obj_size = (cls + 1) * ALIGNMENT;
+    run->num_objs = (SLAB_RUN_SIZE - WSIZE - slab_header_size()) /
+                    run->obj_size;
+    run->num_free = run->num_objs;
+    memset(run->free_map, 0, sizeof(run->free_map));
+    for (size_t i = 0; i < run->num_objs; i++) {
+        run->free_map[i / 32] |= (uint32_t)1 << (i % 32);
+    }
+    list_push_front(&heap->slab_runs[cls], &run->node);
+    return run;
+}
+
+static void *slab_malloc(size_t size) {
+    size_t cls = align(size) / ALIGNMENT - 1;
+    list_node_t *runs = &heap->slab_runs[cls];
+    slab_run_t *run = (slab_run_t *)list_begin(runs);
+    if (list_begin(runs) == list_end(runs) &&
+        (run = slab_run_create(cls)) == NULL) {
+        return NULL;
+    }
+    size_t i;
+    for (i = 0; run->free_map[i] == 0; i++) {
+    }
+    size_t bit = __builtin_ctz(run->free_map[i]);
+    run->free_map[i] &= ~((uint32_t)1 << bit);
+    if (--run->num_free == 0) {
+        list_erase(&run->node);
+    }
+    return (char *)run + slab_header_size() + (i * 32 + bit) * run->obj_size;
+}
+
+static void slab_free(slab_run_t *run, void *ptr) {
+    size_t offset = (char *)ptr - ((char *)run + slab_header_size());
+    size_t idx = offset / run->obj_size;
+    assert(offset % run->obj_size == 0 && idx < run->num_objs &&
+           "invalid slab object");
+    assert(!(run->free_map[idx / 32] >> (idx % 32) & 1) &&
+           "double free or corruption");
+    run->free_map[idx / 32] |= (uint32_t)1 << (idx % 32);
+
+    list_node_t *runs = &heap->slab_runs[run->obj_size / ALIGNMENT - 1];
+    if (run->num_free++ == 0) {
+        list_push_front(runs, &run->node);
+    }
+    if (run->num_free == run->num_objs &&
+        (list_begin(runs) != &run->node || run->node.next != list_end(runs))) {
+        // release the empty run unless it is the last one of its class
+        list_erase(&run->node);
+        size_t chunk = slab_chunk(heap, run);
+        heap->slab_map[chunk / 8] &= ~(1 << (chunk % 8));
+        free_block(run);
+    }
+}
+
+static void slab_mm_check() {
+    for (size_t i = 0; i < SLAB_NUM_CLASSES; i++) {
+        list_node_t *runs = &heap->slab_runs[i];
+        for (list_node_t *node = list_begin(runs); node != list_end(runs);
+             node = node->next) {
+            slab_run_t *run = (slab_run_t *)node;
+            size_t num_free = 0;
+            for (size_t j = 0; j < SLAB_MAX_OBJS / 32; j++) {
+                num_free += __builtin_popcount(run->free_map[j]);
+            }
+            assert(slab_run_of(heap, run) == run && "slab run is not mapped");
+            assert(get_alloc(header_ptr(run)) && "slab run is not allocated");
+            assert(run->obj_size == (i + 1) * ALIGNMENT &&
+                   "slab run in wrong class");
+            assert(run->num_free == num_free && run->num_free > 0 &&
+                   "corrupted slab run");
+        }
+    }
+}
+#endif
+
+#ifdef MM_REMOTE_FREE
+/*
+ * Remote frees.
+ *
+ * A block freed by a thread of another arena is freed right away only if the
+ * lock of that arena is free, so that producer and consumer threads do not
+ * fight over the lock of the producer's arena. Otherwise, it is pushed onto
+ * the remote_frees stack of its arena, linked through its payload, with a
+ * compare-and-swap. The blocks stay marked as allocated until a thread holding
+ * the lock of the arena takes the whole stack at once and frees them. Since
+ * the stack is only ever emptied as a whole, a push cannot be confused by a
+ * block that was popped and pushed again in between (ABA).
+ *
+ * An arena that no thread allocates from any more still gets its stack
+ * drained by the next free that finds its lock free, and once a stack holds
+ * REMOTE_FREE_MAX_COUNT blocks, frees wait for the lock of the arena instead
+ * of queueing more.
+ */
+
+static const size_t REMOTE_FREE_MAX_COUNT = 1024;
+
+/*
+ * Switches to the heap owning ptr and locks it, like heap_enter, unless ptr
+ * belongs to another arena whose lock is held. Then ptr is queued on that
+ * arena and 1 is returned.
+ */
+static inline int heap_enter_free(void *ptr) {
+    int idx;
+    heap_t *owner;
+    if (ptr == NULL || (idx = mem_arena_of(ptr)) < 0 ||
+        (owner = &arenas[idx]) == heap_owner(NULL) ||
+        __atomic_load_n(&owner->remote_count, __ATOMIC_RELAXED) >=
+            REMOTE_FREE_MAX_COUNT) {
+        heap_enter(ptr);
+        return 0;
+    }
+    if (pthread_mutex_trylock(&owner->lock) == 0) {
+        heap = owner;
+        heap->lock_acquired++;
+        return 0;
+    }
+    // on failure, the exchange stores the new top as the link of ptr
+    void **link = ptr;
+    *link = __atomic_load_n(&owner->remote_frees, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&owner->remote_frees, link, ptr, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    __atomic_fetch_add(&owner->remote_count, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// blocks may be pushed meanwhile, but only on top of the ones checked
+static void remote_mm_check() {
+    for (void *bp = __atomic_load_n(&heap->remote_frees, __ATOMIC_ACQUIRE);
+         bp != NULL; bp = *(void **)bp) {
+        assert(mem_arena_of(bp) == heap - arenas &&
+               "remote free queued on the wrong arena");
+    }
+}
+#else
+static inline int heap_enter_free(void *ptr) {
+    heap_enter(ptr);
+    return 0;
+}
+#endif
+
+#ifdef MM_CHECK_INCREMENTAL
+/* Checks a block changed by the last request, along with its neighbors */
+static void mm_check_touched(void *bp) {
+    assert((char *)bp >= (char *)heap->block_head &&
+           (char *)bp < (char *)heap->block_tail && "block outside of heap");
+    if (!get_prev_alloc(header_ptr(bp))) {
+        mm_check_block(prev_block(bp), MIN_BLOCK_SIZE);
+    }
+    mm_check_block(bp, MIN_BLOCK_SIZE);
+    if (next_block(bp) != heap->block_tail) {
+        mm_check_block(next_block(bp), MIN_BLOCK_SIZE);
+    } else {
+        mm_check_tail();
+    }
+    assert((get_alloc(header_ptr(bp)) || free_list_contains(bp)) &&
+           "free block missing from free list");
+}
+
+/*
+ * Checks the blocks changed since the last check, and the next window of the
+ * heap and of the free lists. The window of the heap starts where the last one
+ * ended and wraps around at the end of the heap.
+ */
+static void mm_check_incremental() {
+    for (size_t i = 0; i < CHECK_NUM_TOUCHED; i++) {
+        if (heap->check_touched[i] != NULL) {
+            mm_check_touched(heap->check_touched[i]);
+            heap->check_touched[i] = NULL;
+        }
+    }
+    void *bp = heap->check_cursor ? heap->check_cursor : heap->block_head;
+    for (size_t n = 0; n < MM_CHECK_WINDOW && bp != heap->block_tail; n++) {
+        mm_check_block(bp, MIN_BLOCK_SIZE);
+        bp = next_block(bp);
+    }
+    if (bp == heap->block_tail) {
+        // once per pass over the heap, check the structures kept beside it
+        mm_check_tail();
+#ifdef MM_DEFERRED_COALESCING
+        quick_mm_check();
+#endif
+#ifdef MM_SLAB
+        slab_mm_check();
+#endif
+#ifdef MM_MMAP
+        mmap_mm_check();
+#endif
+#ifdef MM_REMOTE_FREE
+        remote_mm_check();
+#endif
+        bp = NULL;
+    }
+    heap->check_cursor = bp;
+    do_mm_check_sample(heap->check_round++, MM_CHECK_WINDOW);
+}
+#endif
+
+static inline void mm_check() {
+#ifdef MM_CHECK_INCREMENTAL
+    mm_check_incremental();
+#else
     do_mm_check();
+#ifdef MM_DEFERRED_COALESCING
+    quick_mm_check();
+#endif
+#ifdef MM_SLAB
+    slab_mm_check();
+#endif
+#ifdef MM_MMAP
+    mmap_mm_check();
+#endif
+#ifdef MM_REMOTE_FREE
+    remote_mm_check();
+#endif
+#endif
+}
+
+static int do_mm_init(void) {
+    free_list_init();
+    memset(&heap->stats, 0, sizeof(heap->stats));
+#ifdef MM_PROFILE
+    memset(&heap->profile, 0, sizeof(heap->profile));
+#endif
+#ifdef MM_CHECK_INCREMENTAL
+    memset(heap->check_touched, 0, sizeof(heap->check_touched));
+    heap->check_cursor = NULL;
+    heap->check_round = 0;
+#endif
+    if ((heap->block_head = heap_sbrk(4 * WSIZE)) == (void *)-1) {
+        return -1;
+    }
+#ifdef MM_DEFERRED_COALESCING
+    quick_init();
+#endif
+#ifdef MM_SLAB
+    slab_init(heap->block_head);
+#endif
+    heap->block_head = (char *)heap->block_head + 2 * WSIZE;
+    heap->block_tail = (char *)heap->block_head + 2 * WSIZE;
+    set_meta(header_ptr(heap->block_head), 2 * WSIZE, 1, 1);
+    set_meta(header_ptr(heap->block_tail), 0, 1, 1);
+    heap->fresh = heap->block_tail;
+    heap->placed = NULL;
+#ifdef MM_REMOTE_FREE
+    heap->remote_frees = NULL;
+    heap->remote_count = 0;
+#endif
+    return 0;
+}
+
+static void *do_mm_malloc(size_t size) {
+    if (size == 0) {
+        return NULL;
+    }
+#ifdef MM_SLAB
+    void *ptr;
+    if (size <= SLAB_MAX_SIZE && (ptr = slab_malloc(size)) != NULL) {
+        return ptr;
+    }
+#endif
+#ifdef MM_MMAP
+    if (size >= MM_MMAP_THRESHOLD) {
+        void *mapped;
+        if ((mapped = mmap_malloc(size)) != NULL) {
+            return mapped;
+        }
+    }
+#endif
+    if (size > INT_MAX) {
+        return NULL;
+    }
+    profile_request(size);
+    return alloc_block(MAX(align(size + WSIZE), MIN_BLOCK_SIZE));
+}
+
+static void do_mm_free(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+#ifdef MM_MMAP
+    if (mmap_is_mapped(ptr)) {
+        mmap_free(ptr);
+        return;
+    }
+#endif
+#ifdef MM_SLAB
+    slab_run_t *run;
+    if ((run = slab_run_of(heap, ptr)) != NULL) {
+        slab_free(run, ptr);
+        return;
+    }
+#endif
+    set_grown(header_ptr(ptr), 0);
+    check_touch(ptr);
+    profile_free(ptr);
+#ifdef MM_DEFERRED_COALESCING
+    if (quick_push(ptr)) {
+        return;
+    }
+#endif
+    free_block(ptr);
+}
+
+/* Frees the blocks that threads of other arenas queued on the current heap */
+static void remote_drain() {
+#ifdef MM_REMOTE_FREE
+    if (__atomic_load_n(&heap->remote_frees, __ATOMIC_RELAXED) == NULL) {
+        return;
+    }
+    void *bp = __atomic_exchange_n(&heap->remote_frees, NULL, __ATOMIC_ACQUIRE);
+    size_t count = 0;
+    while (bp != NULL) {
+        void *next = *(void **)bp;
+        do_mm_free(bp);
+        bp = next;
+        count++;
+    }
+    __atomic_fetch_sub(&heap->remote_count, count, __ATOMIC_RELAXED);
+#endif
+}
+
+static void *do_mm_realloc(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return do_mm_malloc(size);
+    }
+    if (size == 0) {
+        do_mm_free(ptr);
+        return NULL;
+    }
+#ifdef MM_MMAP
+    if (mmap_is_mapped(ptr)) {
+        if (size >= MM_MMAP_THRESHOLD) {
+            return mmap_realloc(ptr, size);
+        }
+        void *new_ptr;
+        if ((new_ptr = do_mm_malloc(size)) == NULL) {
+            return NULL;
+        }
+        memcpy(new_ptr, ptr, size);
+        mmap_free(ptr);
+        return new_ptr;
+    }
+#endif
+#ifdef MM_SLAB
+    slab_run_t *run;
+    if ((run = slab_run_of(heap, ptr)) != NULL) {
+        if (size <= run->obj_size) {
+            return ptr;
+        }
+        void *new_ptr;
+        if ((new_ptr = do_mm_malloc(size)) == NULL) {
+            return NULL;
+        }
+        memcpy(new_ptr, ptr, run->obj_size);
+        slab_free(run, ptr);
+        return new_ptr;
+    }
+#endif
+#ifdef MM_MMAP
+    // a block growing huge moves to a mapping instead of growing the heap
+    int stays_in_heap = size < MM_MMAP_THRESHOLD;
+#else
+    int stays_in_heap = 1;
+#endif
+    if (stays_in_heap && size > INT_MAX) {
+        return NULL;
+    }
+    size_t block_size = get_size(header_ptr(ptr));
+    size_t old_size = block_size - WSIZE;
+
+    size_t alloc_size = MAX(align(size + WSIZE), MIN_BLOCK_SIZE);
+    int growing = alloc_size > block_size;
+
+    void *next_bp = next_block(ptr);
+    size_t next_free =
+        get_alloc(header_ptr(next_bp)) ? 0 : get_size(header_ptr(next_bp));
+    size_t prev_free =
+        get_prev_alloc(header_ptr(ptr)) ? 0 : get_size(prev_footer_ptr(ptr));
+    if (block_size + next_free < alloc_size && stays_in_heap &&
+        (next_free ? next_block(next_bp) : next_bp) == heap->block_tail) {
+        // extend heap by the missing bytes, which join the next free block
+        if (extend_heap(alloc_size - block_size - next_free) == NULL) {
+            return NULL;
+        }
+        next_free = get_size(header_ptr(next_bp));
+    }
+
+    if (next_free) {
+        // merge next free block
+        unlink_free_block(next_bp);
+        stats_set(coalesces, heap->stats.coalesces + 1);
+        check_forget(next_bp, ptr);
+        block_size += next_free;
+        set_size(header_ptr(ptr), block_size);
+        set_prev_alloc(header_ptr(next_block(ptr)), 1);
+        fresh_claim(ptr);
+    }
+
+    if (block_size < alloc_size && block_size + prev_free >= alloc_size) {
+        // absorb previous free block, moving the payload down
+        void *prev_bp = prev_block(ptr);
+        unlink_free_block(prev_bp);
+        stats_set(coalesces, heap->stats.coalesces + 1);
+        check_forget(ptr, prev_bp);
+        memmove(prev_bp, ptr, old_size);
+        block_size += prev_free;
+        set_meta(header_ptr(prev_bp), block_size, 1, 1);
+        ptr = prev_bp;
+    }
+
+    if (alloc_size <= block_size) {
+        // in-place realloc, shrink to fit
+        check_touch(ptr);
+        shrink_block(ptr, alloc_size);
+        set_grown(header_ptr(ptr), growing);
+        return ptr;
+    }
+
+    if (stays_in_heap && get_grown(header_ptr(ptr))) {
+        // the block keeps growing, so leave room for the next reallocs
+        alloc_size = MAX(alloc_size, align(old_size + (old_size >> 1)));
+    }
+    void *new_ptr;
+    if (stays_in_heap) {
+        profile_request(size);
+    }
+    if ((new_ptr = stays_in_heap ? alloc_block(alloc_size)
+                                 : do_mm_malloc(size)) == NULL) {
+        return NULL;
+    }
+    memcpy(new_ptr, ptr, MIN(size, old_size));
+    free_block(ptr);
+    if (stays_in_heap) {
+        set_grown(header_ptr(new_ptr), 1);
+    }
+    return new_ptr;
+}
+
+/*
+ * Allocates size bytes for calloc, and sets *dirty to the number of leading
+ * payload bytes that may hold old data. Only a block just placed in fresh
+ * memory or a mapped chunk is known to read as zeros.
+ */
+static void *do_mm_calloc(size_t size, size_t *dirty) {
+    *dirty = size;
+    heap->placed = NULL;
+    void *ptr;
+    if ((ptr = do_mm_malloc(size)) == NULL) {
+        return NULL;
+    }
+#ifdef MM_MMAP
+    if (mmap_is_mapped(ptr)) {
+        *dirty = 0;
+        return ptr;
+    }
+#endif
+#ifdef MM_SLAB
+    if (slab_run_of(heap, ptr) != NULL) {
+        return ptr;
+    }
+#endif
+    if (ptr == heap->placed) {
+        *dirty = MIN(size, (size_t)((char *)heap->placed_zero - (char *)ptr));
+    }
+    return ptr;
+}
+
+/*
+ * Aligned requests are always served by heap blocks, since slab objects and
+ * mapped chunks are only aligned to ALIGNMENT.
+ */
+static void *do_mm_memalign(size_t alignment, size_t size) {
+    if (alignment <= ALIGNMENT) {
+        return do_mm_malloc(size);
+    }
+    if (size == 0 || size > INT_MAX || alignment > INT_MAX / 2) {
+        return NULL;
+    }
+    profile_request(size);
+    return alloc_aligned_block(alignment,
+                               MAX(align(size + WSIZE), MIN_BLOCK_SIZE));
+}
+
+static size_t do_mm_usable_size(void *ptr) {
+#ifdef MM_SLAB
+    slab_run_t *run;
+    if ((run = slab_run_of(heap, ptr)) != NULL) {
+        return run->obj_size;
+    }
+#endif
+    // mapped chunks end with a block header as well
+    return get_size(header_ptr(ptr)) - WSIZE;
+}
+
+#ifdef MM_TCACHE
+/*
+ * Per-thread caches of small blocks.
+ *
+ * Each thread owns one bin per segregated size class up to TCACHE_MAX_SIZE.
+ * A freed small block is pushed onto the bin of its size class and stays
+ * marked as allocated in the heap, so it is neither coalesced nor visible to
+ * other threads. Requests are served from the bin of their size class without
+ * taking the heap lock. The lock is only taken in batches: a miss allocates
+ * TCACHE_FILL_COUNT blocks of the requested size at once, and a full bin
+ * returns half of its blocks to the heap at once. With MM_SLAB, requests small
+ * enough for the slabs bypass the bins.
+ *
+ * Blocks in a bin are linked through their payloads, next to a key that marks
+ * them as cached by the thread, as in glibc. A block freed while it holds the
+ * key is looked up in its bin, so that a repeat free asserts instead of
+ * caching the block twice. Blocks too small for the link and the key bypass
+ * the bins. Bins that were filled before the last mm_init belong to a
+ * discarded heap, so each cache remembers the heap epoch it was filled in and
+ * drops its bins once that is stale.
+ */
+
+static const size_t TCACHE_MAX_SIZE = 64 * SEGREGATED_MIN_BLOCK_SIZE;
+static const size_t TCACHE_MAX_COUNT = 16;
+static const size_t TCACHE_FILL_COUNT = 8;
+#define TCACHE_NUM_BINS SEGREGATED_NUM_LISTS
+
+typedef struct tcache_entry {
+    struct tcache_entry *next;
+    void *key; // the tcache of the thread while cached
+} tcache_entry_t;
+
+typedef struct {
+    size_t epoch;
+    tcache_entry_t *bins[TCACHE_NUM_BINS];
+    size_t counts[TCACHE_NUM_BINS];
+} tcache_t;
+
+static size_t heap_epoch;
+static __thread tcache_t tcache;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+static inline void tcache_reset() {
+    memset(&tcache, 0, sizeof(tcache));
+    tcache.epoch = heap_epoch;
+}
+
+/* Requests up to SLAB_MAX_SIZE bypass the bins and go to the slabs */
+static inline int tcache_slab_size(size_t size) {
+#ifdef MM_SLAB
+    return size <= SLAB_MAX_SIZE;
+#else
+    return 0;
+#endif
+}
+
+static inline void tcache_push(size_t idx, void *bp) {
+    tcache_entry_t *entry = bp;
+    entry->next = tcache.bins[idx];
+    entry->key = &tcache;
+    tcache.bins[idx] = entry;
+    tcache.counts[idx]++;
+}
+
+// returns up to count blocks of a bin to the heaps owning them
+static void tcache_flush_bin(size_t idx, size_t count) {
+    heap_t *locked = NULL;
+    for (; count && tcache.bins[idx] != NULL; count--) {
+        tcache_entry_t *entry = tcache.bins[idx];
+        tcache.bins[idx] = entry->next;
+        tcache.counts[idx]--;
+        if (heap_owner(entry) != locked) {
+            // only relock when the owner changes
+            if (locked != NULL) {
+                heap_unlock();
+                locked = NULL;
+            }
+            if (heap_enter_free(entry)) {
+                continue;
+            }
+            remote_drain();
+            locked = heap;
+        }
+        do_mm_free(entry);
+    }
+    if (locked != NULL) {
+        heap_unlock();
+    }
+}
+
+static void tcache_destroy(void *unused) {
+    if (tcache.epoch == heap_epoch) {
+        for (size_t i = 0; i < TCACHE_NUM_BINS; i++) {
+            tcache_flush_bin(i, SIZE_MAX);
+        }
+    }
+    tcache_reset();
+}
+
+static void tcache_key_init() { pthread_key_create(&tcache_key, tcache_destroy); }
+
+static inline int tcache_usable() {
+    if (tcache.epoch != heap_epoch) {
+        if (tcache.epoch == 0) {
+            // first use in this thread, flush the bins on thread exit
+            pthread_once(&tcache_key_once, tcache_key_init);
+            pthread_setspecific(tcache_key, &tcache);
+        }
+        tcache_reset();
+    }
+    return tcache.epoch != 0;
+}
+
+static inline void *tcache_get(size_t size) {
+    if (size == 0 || !tcache_usable()) {
+        return NULL;
+    }
+    size_t alloc_size = MAX(align(size + WSIZE), MIN_BLOCK_SIZE);
+    if (alloc_size > TCACHE_MAX_SIZE ||
+        alloc_size - WSIZE < sizeof(tcache_entry_t) ||
+        tcache_slab_size(size)) {
+        return NULL;
+    }
+    size_t idx = segregated_free_list_lower_bound(alloc_size);
+    tcache_entry_t **link = &tcache.bins[idx];
+    for (tcache_entry_t *entry = *link; entry != NULL;
+         link = &entry->next, entry = entry->next) {
+        if (get_size(header_ptr(entry)) >= alloc_size) {
+            *link = entry->next;
+            tcache.counts[idx]--;
+            entry->key = NULL;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// refills the bin after a miss, must be called with the heap lock held
+static void tcache_fill(size_t size) {
+    size_t alloc_size = MAX(align(size + WSIZE), MIN_BLOCK_SIZE);
+    if (alloc_size > TCACHE_MAX_SIZE ||
+        alloc_size - WSIZE < sizeof(tcache_entry_t) ||
+        tcache_slab_size(size) || tcache.epoch == 0) {
+        return;
+    }
+    size_t idx = segregated_free_list_lower_bound(alloc_size);
+    while (tcache.counts[idx] < TCACHE_FILL_COUNT) {
+        void *bp;
+        if ((bp = do_mm_malloc(alloc_size - WSIZE)) == NULL) {
+            return;
+        }
+        tcache_push(idx, bp);
+    }
+}
+
+static inline int tcache_put(void *ptr) {
+    if (ptr == NULL || !tcache_usable()) {
+        return 0;
+    }
+#ifdef MM_SLAB
+    if (slab_run_of(heap_owner(ptr), ptr) != NULL) {
+        return 0;
+    }
+#endif
+    size_t block_size = get_size(header_ptr(ptr));
+    if (block_size > TCACHE_MAX_SIZE ||
+        block_size - WSIZE < sizeof(tcache_entry_t) ||
+        tcache_slab_size(block_size - WSIZE)) {
+        return 0;
+    }
+    size_t idx = segregated_free_list_lower_bound(block_size);
+    if (((tcache_entry_t *)ptr)->key == &tcache) {
+        // probably a repeat free, unless the payload just holds the same bits
+        for (tcache_entry_t *entry = tcache.bins[idx]; entry != NULL;
+             entry = entry->next) {
+            assert(entry != ptr && "double free or corruption");
+        }
+    }
+    set_grown(header_ptr(ptr), 0);
+    tcache_push(idx, ptr);
+    if (tcache.counts[idx] >= TCACHE_MAX_COUNT) {
+        tcache_flush_bin(idx, TCACHE_MAX_COUNT / 2);
+    }
+    return 1;
+}
+#endif
+
+#ifdef MM_THREAD_SAFE
+static pthread_once_t heap_lock_once = PTHREAD_ONCE_INIT;
+
+static void heap_lock_init() {
+#ifdef MM_ARENAS
+    for (size_t i = 0; i < MM_ARENAS; i++) {
+        pthread_mutex_init(&arenas[i].lock, NULL);
+    }
+#else
+    pthread_mutex_init(&heap->lock, NULL);
+#endif
+}
+#endif
+
+static int mm_init_heap(void) {
+    heap_lock();
+#ifdef MM_THREAD_SAFE
+    heap->lock_acquired = heap->lock_contended = 0;
+#endif
+    int ret = do_mm_init();
+#ifdef MM_CHECK
+    mm_check();
+#endif
+#ifdef MM_VERBOSE
+    printf("\nINIT:\n");
+    do_mm_print();
+#endif
+    heap_unlock();
+    return ret;
+}
+
+int mm_init(void) {
+#ifdef MM_THREAD_SAFE
+    pthread_once(&heap_lock_once, heap_lock_init);
+#endif
+    int ret = 0;
+#ifdef MM_COMPACT
+    heap_base = mem_heap_lo();
+#endif
+#ifdef MM_MMAP
+    mmap_init();
+#endif
+#ifdef MM_ARENAS
+    if (MM_ARENAS > mem_num_arenas()) {
+        return -1;
+    }
+    for (size_t i = 0; i < MM_ARENAS && ret == 0; i++) {
+        heap = &arenas[i];
+        ret = mm_init_heap();
+    }
+#else
+    ret = mm_init_heap();
+#endif
+#ifdef MM_TCACHE
+    heap_epoch++;
+#endif
+    return ret;
+}
+
+void *mm_malloc(size_t size) {
+    void *ptr;
+#ifdef MM_TCACHE
+    if ((ptr = tcache_get(size)) != NULL) {
+        return ptr;
+    }
+#endif
+    heap_enter(NULL);
+    remote_drain();
+    ptr = do_mm_malloc(size);
+#ifdef MM_TCACHE
+    if (ptr != NULL) {
+        tcache_fill(size);
+    }
+#endif
+#ifdef MM_CHECK
+    mm_check();
+#endif
+#ifdef MM_VERBOSE
+    printf("MALLOC %d:\n", size);
+    do_mm_print();
+#endif
+    heap_unlock();
+    return ptr;
+}
+
+/*
+ * The payload is cleared after the heap is unlocked, and only as far as it may
+ * hold old data.
+ */
+void *mm_calloc(size_t nmemb, size_t size) {
+    size_t total, dirty;
+    if (__builtin_mul_overflow(nmemb, size, &total)) {
+        return NULL;
+    }
+    void *ptr;
+#ifdef MM_TCACHE
+    if ((ptr = tcache_get(total)) != NULL) {
+        memset(ptr, 0, total);
+        return ptr;
+    }
+#endif
+    heap_enter(NULL);
+    remote_drain();
+    ptr = do_mm_calloc(total, &dirty);
+#ifdef MM_TCACHE
+    if (ptr != NULL) {
+        tcache_fill(total);
+    }
+#endif
+#ifdef MM_CHECK
+    mm_check();
+#endif
+#ifdef MM_VERBOSE
+    printf("CALLOC %zu:\n", total);
+    do_mm_print();
+#endif
+    heap_unlock();
+    if (ptr != NULL) {
+        memset(ptr, 0, dirty);
+    }
+    return ptr;
+}
+
+void mm_free(void *ptr) {
+#ifdef MM_TCACHE
+    if (tcache_put(ptr)) {
+        return;
+    }
+#endif
+    if (heap_enter_free(ptr)) {
+        return;
+    }
+    remote_drain();
+    do_mm_free(ptr);
+#ifdef MM_CHECK
+    mm_check();
 #endif
 #ifdef MM_VERBOSE
     printf("FREE %p:\n", ptr);
     do_mm_print();
 #endif
+    heap_unlock();
 }
 
 void *mm_realloc(void *ptr, size_t size) {
+    heap_enter(ptr);
+    remote_drain();
     void *p = do_mm_realloc(ptr, size);
 #ifdef MM_CHECK
-    do_mm_check();
+    mm_check();
 #endif
 #ifdef MM_VERBOSE
     printf("REALLOC %d at %p:\n", size, ptr);
     do_mm_print();
 #endif
+    heap_unlock();
     return p;
 }
+
+void *mm_memalign(size_t alignment, size_t size) {
+    if (alignment & (alignment - 1)) {
+        return NULL;
+    }
+    heap_enter(NULL);
+    remote_drain();
+    void *ptr = do_mm_memalign(alignment, size);
+#ifdef MM_CHECK
+    mm_check();
+#endif
+#ifdef MM_VERBOSE
+    printf("MEMALIGN %zu %zu:\n", alignment, size);
+    do_mm_print();
+#endif
+    heap_unlock();
+    return ptr;
+}
+
+/* C11 aligned_alloc, which also rejects an alignment of 0 */
+void *mm_aligned_alloc(size_t alignment, size_t size) {
+    if (alignment == 0) {
+        return NULL;
+    }
+    return mm_memalign(alignment, size);
+}
+
+size_t mm_usable_size(void *ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+    heap_enter(ptr);
+    size_t size = do_mm_usable_size(ptr);
+    heap_unlock();
+    return size;
+}
+
+/*
+ * Adds the statistics of heap h to stats. The counters are read without the
+ * lock of h, so they may come from either side of a request in progress.
+ */
+static void heap_add_stats(heap_t *h, mm_stats_t *stats) {
+    size_t heap_bytes = stats_get(h, heap_bytes);
+    size_t free_bytes = stats_get(h, free_bytes);
+    stats->heap_bytes += heap_bytes;
+    stats->live_bytes += heap_bytes > free_bytes ? heap_bytes - free_bytes : 0;
+    stats->free_bytes += free_bytes;
+    stats->largest_free = MAX(stats->largest_free, stats_get(h, largest_free));
+    for (size_t i = 0; i < MM_STATS_CLASSES; i++) {
+        stats->free_blocks[i] += stats_get(h, free_blocks[i]);
+        stats->free_class_bytes[i] += stats_get(h, free_class_bytes[i]);
+    }
+    stats->extends += stats_get(h, extends);
+    stats->splits += stats_get(h, splits);
+    stats->coalesces += stats_get(h, coalesces);
+}
+
+void mm_stats(mm_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+#ifdef MM_ARENAS
+    for (size_t i = 0; i < MM_ARENAS; i++) {
+        heap_add_stats(&arenas[i], stats);
+    }
+#else
+    heap_add_stats(heap, stats);
+#endif
+#ifdef MM_MMAP
+    stats->mapped_bytes = __atomic_load_n(&mmap_bytes, __ATOMIC_RELAXED);
+#endif
+    if (stats->free_bytes > 0) {
+        stats->fragmentation =
+            1.0 - (double)MIN(stats->largest_free, stats->free_bytes) /
+                      stats->free_bytes;
+    }
+}
+
+/*
+ * Counts the pages of 2^shift bytes that [lo, hi) covers from *next on, the
+ * first page not counted yet, for ranges visited in address order.
+ */
+static inline size_t count_pages(void *lo, void *hi, size_t shift,
+                                 uintptr_t *next) {
+    uintptr_t first = MAX((uintptr_t)lo >> shift, *next);
+    uintptr_t last = ((uintptr_t)hi - 1) >> shift;
+    if (first > last) {
+        return 0;
+    }
+    *next = last + 1;
+    return last - first + 1;
+}
+
+/* Adds the pages spanned by the current heap and its allocated blocks */
+static void heap_add_footprint(mm_footprint_t *fp, size_t page_shift) {
+    if (heap->block_head == NULL) {
+        return;
+    }
+    uintptr_t next = 0, huge_next = 0;
+    void *lo = (char *)heap->block_head - 2 * WSIZE;
+    fp->pages += count_pages(lo, heap->block_tail, page_shift, &next);
+    fp->huge_pages +=
+        count_pages(lo, heap->block_tail, FOOTPRINT_HUGE_SHIFT, &huge_next);
+    next = huge_next = 0;
+    for (void *bp = next_block(heap->block_head); bp != heap->block_tail;
+         bp = next_block(bp)) {
+        if (get_alloc(header_ptr(bp))) {
+            void *hi = header_ptr(next_block(bp));
+            fp->live_pages +=
+                count_pages(header_ptr(bp), hi, page_shift, &next);
+            fp->live_huge_pages += count_pages(header_ptr(bp), hi,
+                                               FOOTPRINT_HUGE_SHIFT, &huge_next);
+        }
+    }
+}
+
+void mm_footprint(mm_footprint_t *fp) {
+    size_t page_shift = __builtin_ctzl(mem_pagesize());
+    memset(fp, 0, sizeof(*fp));
+#ifdef MM_ARENAS
+    for (size_t i = 0; i < MM_ARENAS; i++) {
+        heap = &arenas[i];
+        heap_lock();
+        heap_add_footprint(fp, page_shift);
+        heap_unlock();
+    }
+#else
+    heap_lock();
+    heap_add_footprint(fp, page_shift);
+    heap_unlock();
+#endif
+#ifdef MM_MMAP
+    // every page of a mapped chunk is live
+    mmap_list_lock();
+    for (list_node_t *node = list_begin(&mmap_chunks);
+         node != list_end(&mmap_chunks); node = node->next) {
+        mmap_chunk_t *chunk = (mmap_chunk_t *)node;
+        void *hi = (char *)chunk + chunk->map_size;
+        uintptr_t next = 0, huge_next = 0;
+        size_t pages = count_pages(chunk, hi, page_shift, &next);
+        size_t huge_pages =
+            count_pages(chunk, hi, FOOTPRINT_HUGE_SHIFT, &huge_next);
+        fp->pages += pages;
+        fp->live_pages += pages;
+        fp->huge_pages += huge_pages;
+        fp->live_huge_pages += huge_pages;
+    }
+    mmap_list_unlock();
+#endif
+}
+
+int mm_lock_stats(mm_lock_stats_t *stats) {
+#ifdef MM_THREAD_SAFE
+    stats->acquired = stats->contended = 0;
+#ifdef MM_ARENAS
+    for (size_t i = 0; i < MM_ARENAS; i++) {
+        stats->acquired += arenas[i].lock_acquired;
+        stats->contended += arenas[i].lock_contended;
+    }
+#else
+    stats->acquired = heap->lock_acquired;
+    stats->contended = heap->lock_contended;
+#endif
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+#ifdef MM_PROFILE
+static void profile_add_row(profile_row_t *sum, profile_row_t *row) {
+    sum->mallocs += row->mallocs;
+    sum->frees += row->frees;
+    sum->hits += row->hits;
+    sum->misses += row->misses;
+    sum->splits += row->splits;
+    sum->walked += row->walked;
+    for (size_t i = 0; i < PROFILE_NUM_WALKS; i++) {
+        sum->walks[i] += row->walks[i];
+    }
+}
+
+/* Adds the profile of the current heap to profile */
+static void heap_add_profile(heap_profile_t *profile) {
+    for (size_t i = 0; i < PROFILE_NUM_CLASSES; i++) {
+        profile_add_row(&profile->classes[i], &heap->profile.classes[i]);
+    }
+    for (size_t i = 0; i < MM_STATS_CLASSES; i++) {
+        profile_add_row(&profile->requests[i], &heap->profile.requests[i]);
+    }
+}
+
+static inline size_t profile_class_min(size_t i) {
+#ifdef MM_SEGREGATED
+    return segregated_free_list_min_size(i);
+#else
+    return (size_t)1 << i;
+#endif
+}
+static inline size_t profile_class_max(size_t i) {
+#ifdef MM_SEGREGATED
+    return segregated_free_list_max_size(i);
+#else
+    return i < MM_STATS_CLASSES - 1 ? ((size_t)2 << i) - 1 : SIZE_MAX;
+#endif
+}
+
+/* Prints a row that counts any request, leaving an unbounded max_size empty */
+static void profile_print_row(FILE *fp, const char *label, const char *table,
+                              size_t index, size_t min_size, size_t max_size,
+                              profile_row_t *row) {
+    if (row->mallocs == 0 && row->frees == 0) {
+        return;
+    }
+    fprintf(fp, "%s,%s,%zu,%zu,", label, table, index, min_size);
+    if (max_size != SIZE_MAX) {
+        fprintf(fp, "%zu", max_size);
+    }
+    fprintf(fp, ",%lu,%lu,%lu,%lu,%lu,%lu", row->mallocs, row->frees,
+            row->hits, row->misses, row->splits, row->walked);
+    for (size_t i = 0; i < PROFILE_NUM_WALKS; i++) {
+        fprintf(fp, ",%lu", row->walks[i]);
+    }
+    fputc('\n', fp);
+}
+#endif
+
+/*
+ * The heaps are only locked while their counters are summed up, since
+ * writing to fp may allocate.
+ */
+int mm_profile_dump(FILE *fp, const char *label) {
+#ifdef MM_PROFILE
+    if (label == NULL) {
+        fprintf(fp, "table,index,min_size,max_size,mallocs,frees,hits,misses,"
+                    "splits,walked,walk_0");
+        for (size_t i = 1; i < PROFILE_NUM_WALKS; i++) {
+            fprintf(fp, ",walk_%zu", (size_t)1 << (i - 1));
+        }
+        fputc('\n', fp);
+        return 0;
+    }
+    static heap_profile_t profile;
+    static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&profile_lock);
+    memset(&profile, 0, sizeof(profile));
+#ifdef MM_ARENAS
+    for (size_t i = 0; i < MM_ARENAS; i++) {
+        heap = &arenas[i];
+        heap_lock();
+        heap_add_profile(&profile);
+        heap_unlock();
+    }
+#else
+    heap_lock();
+    heap_add_profile(&profile);
+    heap_unlock();
+#endif
+    for (size_t i = 0; i < PROFILE_NUM_CLASSES; i++) {
+        profile_print_row(fp, label, "class", i, profile_class_min(i),
+                          profile_class_max(i), &profile.classes[i]);
+    }
+    for (size_t i = 0; i < MM_STATS_CLASSES; i++) {
+        size_t max_size =
+            i < MM_STATS_CLASSES - 1 ? ((size_t)2 << i) - 1 : SIZE_MAX;
+        profile_print_row(fp, label, "request", i, (size_t)1 << i, max_size,
+                          &profile.requests[i]);
+    }
+    pthread_mutex_unlock(&profile_lock);
+    return 0;
+#else
+    return -1;
+#endif
+}
@@ -5,6 +5,83 @@ extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 
+/* 
+ * mm_calloc returns a zeroed block for nmemb objects of size bytes, or NULL
+ * if the product overflows. mm_memalign and mm_aligned_alloc return a block
+ * whose payload is aligned to alignment, which must be a power of two, or
+ * NULL. mm_usable_size returns the number of bytes that may be used in the
+ * payload of an allocated block.
+ */
+extern void *mm_calloc(size_t nmemb, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+extern size_t mm_usable_size(void *ptr);
+
+/* 
+ * Heap lock statistics since the last mm_init. mm_lock_stats returns -1,
+ * and leaves stats untouched, if the package is not thread-safe.
+ */
+typedef struct {
+    unsigned long acquired;  /* number of times a heap lock was taken */
+    unsigned long contended; /* ... while another thread was holding it */
+} mm_lock_stats_t;
+
+extern int mm_lock_stats(mm_lock_stats_t *stats);
+
+/* 
+ * Heap statistics since the last mm_init. They are kept up to date by every
+ * request, and mm_stats reads them without taking any heap lock, so it is
+ * cheap enough to sample on the hot path. Requests in progress on other
+ * threads may show up in some counters and not yet in others. Sizes
+ * are block sizes, headers included. Blocks held in per-thread caches or
+ * quick lists count as live, and the free blocks are counted by powers of
+ * two: class i holds the free blocks of 2^i to 2^(i+1)-1 bytes.
+ */
+#define MM_STATS_CLASSES 32
+
+typedef struct {
+    size_t heap_bytes;       /* bytes in heap blocks */
+    size_t live_bytes;       /* ... that are allocated */
+    size_t free_bytes;       /* ... that are free */
+    size_t largest_free;     /* size of the largest free block */
+    double fragmentation;    /* 1 - largest_free / free_bytes, 0 if none */
+    size_t mapped_bytes;     /* bytes in chunks mapped with MM_MMAP */
+    size_t free_blocks[MM_STATS_CLASSES];      /* free blocks per class */
+    size_t free_class_bytes[MM_STATS_CLASSES]; /* free bytes per class */
+    unsigned long extends;   /* number of times the heap was grown */
+    unsigned long splits;    /* number of blocks split in two */
+    unsigned long coalesces; /* number of free blocks merged with a neighbor */
+} mm_stats_t;
+
+extern void mm_stats(mm_stats_t *stats);
+
+/* 
+ * TLB footprint of the heap: how many pages, and how many 2 MB huge page
+ * frames, the heap and the mapped chunks span, and how many of them hold
+ * allocated blocks. Unlike mm_stats, mm_footprint walks the whole heap.
+ */
+typedef struct {
+    size_t pages;           /* pages spanned */
+    size_t live_pages;      /* ... holding allocated blocks */
+    size_t huge_pages;      /* 2 MB frames spanned */
+    size_t live_huge_pages; /* ... holding allocated blocks */
+} mm_footprint_t;
+
+extern void mm_footprint(mm_footprint_t *fp);
+
+/* 
+ * Allocation profile since the last mm_init, kept with MM_PROFILE. For each
+ * free list class and each power-of-two bucket of request sizes, it counts
+ * the allocations and frees served by heap blocks, how many allocations
+ * found a free block (hits) or grew the heap (misses), the blocks split, and
+ * how many blocks find_fit looked at, in total and as a histogram.
+ * mm_profile_dump writes one CSV row per class or bucket that saw a request,
+ * each starting with label and a comma, or with label NULL the names of the
+ * columns that follow the label. It returns -1, and writes nothing, if the
+ * package was built without MM_PROFILE.
+ */
+extern int mm_profile_dump(FILE *fp, const char *label);
+
 
 /* 
  * Students work in teams of one or two.  Teams enter their team name, 
@@ -0,0 +1,551 @@
+/*
+ * mmrecord.c - Records the allocation requests of a real program as a trace.
+ *
+ * Built into libmmrecord.so (make libmmrecord.so), this file interposes on
+ * the malloc family of the C library and writes the requests of a program
+ * to a .rep file that mdriver can replay against any build of mm.c:
+ *
+ *   MMRECORD=ls.rep LD_PRELOAD=./libmmrecord.so ls -l
+ *   ./mdriver -f ls.rep
+ *
+ * The file name may contain %p, which stands for the process id, so that
+ * each process of e.g. a build gets its own trace; the default name is
+ * mmrecord.%p.rep. The requests are still served by the C library. A block
+ * gets the next free id when it is allocated and keeps it across reallocs.
+ * calloc and the aligned allocators are recorded as plain allocs, and
+ * zero-byte requests as 1 byte (as libmm.so serves them). Blocks that are
+ * still live when the program exits are left allocated in the trace.
+ *
+ * The id of a block is kept in a small header in front of its payload, so
+ * frees need no shared table. Each thread logs its requests to a buffer of
+ * its own, stamped with a global sequence number, and appends the buffer
+ * to a spool file when it fills up. At exit the spool is put back in
+ * sequence order and written out as the trace.
+ *
+ * Not recorded are blocks larger than INT_MAX bytes (which the trace
+ * format cannot hold), requests made before the library is initialized or
+ * after exit starts, and requests of a forked child until it execs. A
+ * program that is killed or calls _exit leaves only the spool behind.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define EXPORT __attribute__((visibility("default")))
+
+#define REC_BUF_LEN 4096        /* requests per thread buffer */
+#define NO_ID UINT32_MAX        /* id of a block that is not recorded */
+
+/* The C library's allocator, which serves the requests */
+extern void *__libc_malloc(size_t size);
+extern void __libc_free(void *ptr);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+/* Header in front of each payload, which keeps it 16-byte aligned */
+typedef struct {
+    uint32_t id;                /* id of the block in the trace, or NO_ID */
+    uint32_t offset;            /* distance of the payload from the C block */
+    uint64_t size;              /* requested size, for malloc_usable_size */
+} rec_header_t;
+
+/* A logged request */
+typedef struct {
+    uint64_t seq;               /* sequence number << 2 | type */
+    uint32_t id;                /* id of the block */
+    uint32_t size;              /* new size of the block, 0 for frees */
+} rec_t;
+
+enum {REC_NONE, REC_ALLOC, REC_REALLOC, REC_FREE};
+
+/* The log buffer of a thread */
+typedef struct rec_buf {
+    struct rec_buf *next;       /* next buffer in buf_list */
+    int in_use;                 /* owned by a running thread */
+    int count;                  /* number of requests in recs */
+    rec_t recs[REC_BUF_LEN];
+} rec_buf_t;
+
+static int recording;           /* set while requests are logged */
+static uint64_t next_seq;       /* sequence number of the next request */
+static uint32_t next_id;        /* id of the next block */
+
+static char out_name[PATH_MAX];         /* the trace */
+static char spool_name[PATH_MAX + 8];   /* the spool, out_name.spool */
+static int spool_fd = -1;
+
+/* All thread buffers ever made; those not in use are handed out again */
+static pthread_mutex_t buf_lock = PTHREAD_MUTEX_INITIALIZER;
+static rec_buf_t *buf_list;
+static pthread_key_t buf_key;
+static __thread rec_buf_t *my_buf;
+
+static void rec_message(const char *msg) {
+    // stdio may allocate, so write the message directly
+    write(STDERR_FILENO, "libmmrecord.so: ", 16);
+    write(STDERR_FILENO, msg, strlen(msg));
+    write(STDERR_FILENO, "\n", 1);
+}
+
+/*
+ * rec_flush - Append the requests in buf to the spool
+ */
+static void rec_flush(rec_buf_t *buf) {
+    char *data = (char *)buf->recs;
+    size_t len = buf->count * sizeof(rec_t);
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(spool_fd, data, len)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            __atomic_store_n(&recording, 0, __ATOMIC_RELAXED);
+            rec_message("cannot write the spool, recording stopped");
+            break;
+        }
+        data += n;
+        len -= n;
+    }
+    buf->count = 0;
+}
+
+/*
+ * rec_thread_exit - Give back the buffer of a thread that exits
+ */
+static void rec_thread_exit(void *arg) {
+    rec_buf_t *buf = arg;
+
+    rec_flush(buf);
+    my_buf = NULL;
+    pthread_mutex_lock(&buf_lock);
+    buf->in_use = 0;
+    pthread_mutex_unlock(&buf_lock);
+}
+
+/*
+ * rec_thread_buf - Find a buffer for the calling thread, NULL if there is
+ *     no memory for one
+ */
+static rec_buf_t *rec_thread_buf(void) {
+    rec_buf_t *buf;
+
+    pthread_mutex_lock(&buf_lock);
+    for (buf = buf_list; buf != NULL && buf->in_use; buf = buf->next) {
+    }
+    if (buf == NULL) {
+        buf = mmap(NULL, sizeof(rec_buf_t), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buf == MAP_FAILED) {
+            pthread_mutex_unlock(&buf_lock);
+            return NULL;
+        }
+        buf->next = buf_list;
+        buf_list = buf;
+    }
+    buf->in_use = 1;
+    pthread_mutex_unlock(&buf_lock);
+
+    my_buf = buf;
+    pthread_setspecific(buf_key, buf);
+    return buf;
+}
+
+/*
+ * rec_log - Log a request in the buffer of the calling thread
+ */
+static void rec_log(int type, uint32_t id, size_t size) {
+    rec_buf_t *buf = my_buf;
+    rec_t *rec;
+
+    if (!__atomic_load_n(&recording, __ATOMIC_RELAXED)) {
+        return;
+    }
+    if (buf == NULL && (buf = rec_thread_buf()) == NULL) {
+        return;
+    }
+    // relaxed is enough: a block is only handed to another thread after
+    // its alloc returns, and that orders the later requests after it
+    rec = &buf->recs[buf->count];
+    rec->seq = __atomic_fetch_add(&next_seq, 1, __ATOMIC_RELAXED) << 2 | type;
+    rec->id = id;
+    rec->size = size;
+    __atomic_store_n(&buf->count, buf->count + 1, __ATOMIC_RELEASE);
+    if (buf->count == REC_BUF_LEN) {
+        rec_flush(buf);
+    }
+}
+
+/*
+ * rec_alloc - Give a new block of size bytes an id and log its allocation
+ */
+static uint32_t rec_alloc(size_t size) {
+    uint32_t id;
+
+    if (!__atomic_load_n(&recording, __ATOMIC_RELAXED) || size > INT_MAX) {
+        return NO_ID;
+    }
+    if ((id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED)) == NO_ID) {
+        return NO_ID;
+    }
+    rec_log(REC_ALLOC, id, size ? size : 1);
+    return id;
+}
+
+/*
+ * rec_payload - Write the header of a block that the C library allocated
+ *     at base, and return the payload offset bytes into it
+ */
+static inline void *rec_payload(void *base, size_t offset, uint32_t id,
+                                size_t size) {
+    rec_header_t *header = (rec_header_t *)((char *)base + offset) - 1;
+    header->id = id;
+    header->offset = offset;
+    header->size = size;
+    return header + 1;
+}
+
+static inline rec_header_t *rec_header(void *ptr) {
+    return (rec_header_t *)ptr - 1;
+}
+
+static inline void *rec_base(rec_header_t *header) {
+    return (char *)(header + 1) - header->offset;
+}
+
+static void rec_atfork_child(void) {
+    __atomic_store_n(&recording, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * rec_name - Expand the %p in the trace name given by the user
+ */
+static void rec_name(const char *pattern) {
+    size_t len = 0;
+    int n;
+
+    for (; *pattern != '\0' && len < sizeof(out_name) - 1; pattern++) {
+        if (pattern[0] == '%' && pattern[1] == 'p') {
+            n = snprintf(out_name + len, sizeof(out_name) - len, "%d",
+                         (int)getpid());
+            len = (n < 0) ? len : len + n;
+            len = (len < sizeof(out_name)) ? len : sizeof(out_name) - 1;
+            pattern++;
+        } else {
+            out_name[len++] = *pattern;
+        }
+    }
+    out_name[len] = '\0';
+}
+
+/*
+ * rec_init - Start recording once the C library is up
+ */
+__attribute__((constructor)) static void rec_init(void) {
+    const char *pattern = getenv("MMRECORD");
+
+    rec_name((pattern != NULL && *pattern != '\0') ? pattern
+                                                   : "mmrecord.%p.rep");
+    snprintf(spool_name, sizeof(spool_name), "%s.spool", out_name);
+    spool_fd = open(spool_name, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (spool_fd < 0) {
+        rec_message("cannot create the spool, nothing is recorded");
+        return;
+    }
+    if (pthread_key_create(&buf_key, rec_thread_exit) != 0) {
+        rec_message("no thread key, nothing is recorded");
+        return;
+    }
+    pthread_atfork(NULL, NULL, rec_atfork_child);
+    __atomic_store_n(&recording, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * rec_write - Write the spooled requests to the trace in sequence order
+ */
+static void rec_write(void) {
+    struct stat st;
+    rec_t *spool, *order, *rec;
+    uint32_t *live_size;
+    uint64_t nrecs, max_seq = 0, seq, i;
+    unsigned long long num_ops = 0, live = 0, peak = 0, num_ids = 0;
+    FILE *out;
+
+    if (fstat(spool_fd, &st) < 0 || st.st_size < (off_t)sizeof(rec_t)) {
+        rec_message("no requests were recorded");
+        return;
+    }
+    nrecs = st.st_size / sizeof(rec_t);
+    spool = mmap(NULL, nrecs * sizeof(rec_t), PROT_READ, MAP_PRIVATE,
+                 spool_fd, 0);
+    if (spool == MAP_FAILED) {
+        rec_message("cannot map the spool");
+        return;
+    }
+    for (i = 0; i < nrecs; i++) {
+        max_seq = (spool[i].seq >> 2 > max_seq) ? spool[i].seq >> 2 : max_seq;
+    }
+
+    /*
+     * Sequence numbers are unique, so sorting is just putting each request
+     * in its slot. The slots of requests that were lost stay REC_NONE.
+     */
+    order = mmap(NULL, (max_seq + 1) * sizeof(rec_t), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    live_size = mmap(NULL, (size_t)next_id * sizeof(uint32_t) + 1,
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (order == MAP_FAILED || live_size == MAP_FAILED) {
+        rec_message("no memory to sort the spool");
+        return;
+    }
+    for (i = 0; i < nrecs; i++) {
+        order[spool[i].seq >> 2] = spool[i];
+    }
+    munmap(spool, nrecs * sizeof(rec_t));
+
+    /*
+     * Drop the requests on blocks whose alloc was lost, so that mdriver
+     * never frees a block it has not allocated
+     */
+    for (seq = 0; seq <= max_seq; seq++) {
+        rec = &order[seq];
+        switch (rec->seq & 3) {
+        case REC_ALLOC:
+            if (live_size[rec->id] != 0) {
+                rec->seq = REC_NONE;
+                continue;
+            }
+            live += rec->size;
+            live_size[rec->id] = rec->size;
+            num_ids = (rec->id >= num_ids) ? rec->id + 1ULL : num_ids;
+            break;
+        case REC_REALLOC:
+            if (live_size[rec->id] == 0) {
+                rec->seq = REC_NONE;
+                continue;
+            }
+            live = live - live_size[rec->id] + rec->size;
+            live_size[rec->id] = rec->size;
+            break;
+        case REC_FREE:
+            if (live_size[rec->id] == 0) {
+                rec->seq = REC_NONE;
+                continue;
+            }
+            live -= live_size[rec->id];
+            live_size[rec->id] = 0;
+            break;
+        default:
+            continue;
+        }
+        peak = (live > peak) ? live : peak;
+        num_ops++;
+    }
+
+    if ((out = fopen(out_name, "w")) == NULL) {
+        rec_message("cannot create the trace");
+        return;
+    }
+    fprintf(out, "%d\n%llu\n%llu\n%d\n",
+            (peak > INT_MAX) ? INT_MAX : (int)peak, num_ids, num_ops, 1);
+    for (seq = 0; seq <= max_seq; seq++) {
+        rec = &order[seq];
+        switch (rec->seq & 3) {
+        case REC_ALLOC:
+            fprintf(out, "a %u %u\n", rec->id, rec->size);
+            break;
+        case REC_REALLOC:
+            fprintf(out, "r %u %u\n", rec->id, rec->size);
+            break;
+        case REC_FREE:
+            fprintf(out, "f %u\n", rec->id);
+            break;
+        }
+    }
+    if (fclose(out) != 0) {
+        rec_message("cannot write the trace");
+        return;
+    }
+    munmap(order, (max_seq + 1) * sizeof(rec_t));
+    munmap(live_size, (size_t)next_id * sizeof(uint32_t) + 1);
+    unlink(spool_name);
+
+    fprintf(stderr, "libmmrecord.so: %llu requests, %llu blocks, "
+            "peak live %llu bytes in %s\n", num_ops, num_ids, peak, out_name);
+}
+
+/*
+ * rec_fini - Stop recording and write the trace when the program exits
+ */
+__attribute__((destructor)) static void rec_fini(void) {
+    rec_buf_t *buf;
+
+    if (!__atomic_exchange_n(&recording, 0, __ATOMIC_RELAXED)) {
+        return;
+    }
+    // threads still running may be logging into their buffers; requests
+    // flushed twice land in the same slot, so at worst the last few are lost
+    pthread_mutex_lock(&buf_lock);
+    for (buf = buf_list; buf != NULL; buf = buf->next) {
+        rec_flush(buf);
+    }
+    pthread_mutex_unlock(&buf_lock);
+    rec_write();
+    close(spool_fd);
+}
+
+EXPORT void *malloc(size_t size) {
+    void *base;
+
+    if (size > SIZE_MAX - sizeof(rec_header_t)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if ((base = __libc_malloc(size + sizeof(rec_header_t))) == NULL) {
+        return NULL;
+    }
+    return rec_payload(base, sizeof(rec_header_t), rec_alloc(size), size);
+}
+
+EXPORT void free(void *ptr) {
+    rec_header_t *header;
+
+    if (ptr == NULL) {
+        return;
+    }
+    header = rec_header(ptr);
+    if (header->id != NO_ID) {
+        rec_log(REC_FREE, header->id, 0);
+    }
+    __libc_free(rec_base(header));
+}
+
+EXPORT void *calloc(size_t nmemb, size_t size) {
+    size_t total;
+    void *base;
+
+    if (__builtin_mul_overflow(nmemb, size, &total) ||
+        total > SIZE_MAX - sizeof(rec_header_t)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if ((base = __libc_calloc(1, total + sizeof(rec_header_t))) == NULL) {
+        return NULL;
+    }
+    return rec_payload(base, sizeof(rec_header_t), rec_alloc(total), total);
+}
+
+EXPORT void *realloc(void *ptr, size_t size) {
+    rec_header_t *header;
+    uint32_t id;
+    void *base;
+
+    if (ptr == NULL) {
+        return malloc(size);
+    }
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    if (size > SIZE_MAX - sizeof(rec_header_t)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    header = rec_header(ptr);
+    id = header->id;
+
+    if (header->offset == sizeof(rec_header_t)) {
+        base = __libc_realloc(rec_base(header), size + sizeof(rec_header_t));
+        if (base == NULL) {
+            return NULL;
+        }
+    } else {
+        // an aligned block, whose payload is not where the C library's
+        // realloc would copy it to
+        if ((base = __libc_malloc(size + sizeof(rec_header_t))) == NULL) {
+            return NULL;
+        }
+        memcpy((char *)base + sizeof(rec_header_t), ptr,
+               (header->size < size) ? header->size : size);
+        __libc_free(rec_base(header));
+    }
+
+    if (id != NO_ID && size > INT_MAX) {
+        rec_log(REC_FREE, id, 0);
+        id = NO_ID;
+    } else if (id != NO_ID) {
+        rec_log(REC_REALLOC, id, size);
+    }
+    return rec_payload(base, sizeof(rec_header_t), id, size);
+}
+
+EXPORT void *reallocarray(void *ptr, size_t nmemb, size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(nmemb, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, total);
+}
+
+EXPORT void *memalign(size_t alignment, size_t size) {
+    void *base;
+
+    if (alignment <= sizeof(rec_header_t)) {
+        return malloc(size);
+    }
+    if ((alignment & (alignment - 1)) || alignment > (1U << 30)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (size > SIZE_MAX - alignment) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    // the header goes at the end of the first alignment unit
+    if ((base = __libc_memalign(alignment, size + alignment)) == NULL) {
+        return NULL;
+    }
+    return rec_payload(base, alignment, rec_alloc(size), size);
+}
+
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    void *ptr;
+
+    if (alignment % sizeof(void *) || (alignment & (alignment - 1))) {
+        return EINVAL;
+    }
+    if ((ptr = memalign(alignment, size)) == NULL) {
+        return errno;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+EXPORT void *valloc(size_t size) {
+    return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+EXPORT void *pvalloc(size_t size) {
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    return memalign(pagesize, (size + pagesize - 1) & ~(pagesize - 1));
+}
+
+EXPORT size_t malloc_usable_size(void *ptr) {
+    return (ptr == NULL) ? 0 : rec_header(ptr)->size;
+}
@@ -0,0 +1,195 @@
+/*
+ * mmshim.c - Runs the mm package as the malloc of a real program.
+ *
+ * Built into libmm.so (make libmm.so), this file exports the malloc family
+ * of the C library on top of the mm package, so that any dynamically linked
+ * program can be run and measured on it:
+ *
+ *   LD_PRELOAD=./libmm.so ls -l
+ *
+ * memlib and the mm package are initialized by the first call. Since the
+ * program may have many threads, the library is always built with
+ * MM_THREAD_SAFE, and with MM_ALIGNMENT=16 to keep the alignment that the C
+ * library guarantees. memlib reserves MAX_HEAP bytes of address space for
+ * each arena up front, but the pages are only backed by memory as the brk
+ * grows over them, so the heap can grow as far as the program needs.
+ *
+ * The heap locks are not taken around fork, so a child forked while another
+ * thread is in the mm package must exec before it allocates.
+ *
+ * Built with MM_PROFILE, the allocation profile is appended as CSV to the file
+ * named by MMPROFILE, if it is set, when the program exits and whenever the
+ * process receives SIGUSR1. Since stdio is not async-signal-safe, the signal
+ * only raises a flag, and the next malloc or free writes the profile.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "memlib.h"
+#include "mm.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+static pthread_once_t shim_once = PTHREAD_ONCE_INIT;
+
+#ifdef MM_PROFILE
+static const char *profile_name;
+static volatile sig_atomic_t profile_requested;
+static int profile_dumps;
+
+/* Appends the profile, labeled with the pid and a dump number */
+static void shim_profile_dump(void) {
+    char label[32];
+    FILE *fp;
+    if ((fp = fopen(profile_name, "a")) == NULL) {
+        return;
+    }
+    fseek(fp, 0, SEEK_END);
+    if (ftell(fp) == 0) {
+        fputs("pid,dump,", fp);
+        mm_profile_dump(fp, NULL);
+    }
+    snprintf(label, sizeof(label), "%d,%d", (int)getpid(), profile_dumps++);
+    mm_profile_dump(fp, label);
+    fclose(fp);
+}
+
+static void shim_profile_signal(int sig) { profile_requested = 1; }
+
+static void shim_profile_init(void) {
+    if ((profile_name = getenv("MMPROFILE")) != NULL) {
+        signal(SIGUSR1, shim_profile_signal);
+    }
+}
+
+__attribute__((destructor)) static void shim_profile_fini(void) {
+    if (profile_name != NULL) {
+        shim_profile_dump();
+    }
+}
+
+static inline void shim_profile_poll(void) {
+    if (profile_requested) {
+        // cleared first, as writing the profile allocates
+        profile_requested = 0;
+        shim_profile_dump();
+    }
+}
+#else
+static inline void shim_profile_init(void) {}
+static inline void shim_profile_poll(void) {}
+#endif
+
+static void shim_init(void) {
+    static const char msg[] = "libmm.so: mm_init failed\n";
+#ifdef MM_ARENAS
+    mem_set_arenas(MM_ARENAS);
+#endif
+    mem_init();
+    if (mm_init() < 0) {
+        // stdio may allocate, so write the message directly
+        write(STDERR_FILENO, msg, sizeof(msg) - 1);
+        abort();
+    }
+    shim_profile_init();
+}
+
+static inline void shim_enter(void) { pthread_once(&shim_once, shim_init); }
+
+/* Sets errno as the C library does when an allocation fails */
+static inline void *shim_result(void *ptr) {
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+EXPORT void *malloc(size_t size) {
+    shim_enter();
+    shim_profile_poll();
+    // the C library hands out a unique pointer even for 0 bytes
+    return shim_result(mm_malloc(size ? size : 1));
+}
+
+EXPORT void free(void *ptr) {
+    shim_profile_poll();
+    if (ptr != NULL) {
+        mm_free(ptr);
+    }
+}
+
+EXPORT void *calloc(size_t nmemb, size_t size) {
+    shim_enter();
+    if (nmemb == 0 || size == 0) {
+        nmemb = size = 1;
+    }
+    // mm_calloc fails on overflow and skips clearing fresh memory
+    return shim_result(mm_calloc(nmemb, size));
+}
+
+EXPORT void *realloc(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return malloc(size);
+    }
+    if (size == 0) {
+        mm_free(ptr);
+        return NULL;
+    }
+    return shim_result(mm_realloc(ptr, size));
+}
+
+EXPORT void *reallocarray(void *ptr, size_t nmemb, size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(nmemb, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, total);
+}
+
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment % sizeof(void *) || (alignment & (alignment - 1))) {
+        return EINVAL;
+    }
+    shim_enter();
+    void *ptr = mm_memalign(alignment, size ? size : 1);
+    if (ptr == NULL) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+EXPORT void *memalign(size_t alignment, size_t size) {
+    if (alignment & (alignment - 1)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    shim_enter();
+    return shim_result(mm_memalign(alignment, size ? size : 1));
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size) {
+    if (alignment & (alignment - 1)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    shim_enter();
+    return shim_result(mm_aligned_alloc(alignment, size ? size : 1));
+}
+
+EXPORT void *valloc(size_t size) {
+    return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+EXPORT void *pvalloc(size_t size) {
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    return memalign(pagesize, (size + pagesize - 1) & ~(pagesize - 1));
+}
+
+EXPORT size_t malloc_usable_size(void *ptr) { return mm_usable_size(ptr); }
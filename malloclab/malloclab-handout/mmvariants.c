@@ -0,0 +1,51 @@
+/*
+ * mmvariants.c - The table of mm packages that mdriver evaluates.
+ *
+ * The first entry is the mm package of mm.c as built with MMFLAGS. Built
+ * for mdriver-variants, MM_VARIANT_LIST(X) is defined by the Makefile to
+ * X(name) for each of its VARIANTS, and each variant adds an entry whose
+ * entry points are the ones of mm.c built with MM_VARIANT=name. Like mm.c,
+ * it is built with MMFLAGS, which apply to every variant, so that it knows
+ * how many arenas they use.
+ */
+#include "mm.h"
+#include "mmvariants.h"
+
+#ifndef MM_VARIANT_LIST
+#define MM_VARIANT_LIST(X)
+#endif
+
+#define MM_VARIANT_DECLARE(v)                                           \
+    extern int mm_##v##_init(void);                                     \
+    extern void *mm_##v##_malloc(size_t size);                          \
+    extern void mm_##v##_free(void *ptr);                               \
+    extern void *mm_##v##_realloc(void *ptr, size_t size);              \
+    extern void *mm_##v##_calloc(size_t nmemb, size_t size);            \
+    extern void *mm_##v##_memalign(size_t alignment, size_t size);      \
+    extern void *mm_##v##_aligned_alloc(size_t alignment, size_t size); \
+    extern void mm_##v##_stats(mm_stats_t *stats);                      \
+    extern void mm_##v##_footprint(mm_footprint_t *fp);                 \
+    extern int mm_##v##_lock_stats(mm_lock_stats_t *stats);             \
+    extern int mm_##v##_profile_dump(FILE *fp, const char *label);
+
+#define MM_VARIANT_ENTRY(v)                                             \
+    {#v, mm_##v##_init, mm_##v##_malloc, mm_##v##_free,                 \
+     mm_##v##_realloc, mm_##v##_calloc, mm_##v##_memalign,              \
+     mm_##v##_aligned_alloc, mm_##v##_stats, mm_##v##_footprint,        \
+     mm_##v##_lock_stats, mm_##v##_profile_dump},
+
+MM_VARIANT_LIST(MM_VARIANT_DECLARE)
+
+const mm_variant_t mm_variants[] = {
+    {"mm", mm_init, mm_malloc, mm_free, mm_realloc, mm_calloc, mm_memalign,
+     mm_aligned_alloc, mm_stats, mm_footprint, mm_lock_stats, mm_profile_dump},
+    MM_VARIANT_LIST(MM_VARIANT_ENTRY)
+};
+
+const int mm_num_variants = sizeof(mm_variants) / sizeof(mm_variants[0]);
+
+#ifdef MM_ARENAS
+const int mm_num_arenas = MM_ARENAS;
+#else
+const int mm_num_arenas = 1;
+#endif
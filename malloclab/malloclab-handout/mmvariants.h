@@ -0,0 +1,30 @@
+/*
+ * mmvariants.h - The mm packages that mdriver evaluates.
+ *
+ * The plain mdriver evaluates the single mm package built from mm.c with
+ * MMFLAGS. mdriver-variants also links a variant of mm.c for each
+ * combination of free block organization and placement policy, each
+ * compiled on its own with the policy fixed, and evaluates them side by
+ * side (mdriver -m selects some of them). Include it after mm.h.
+ */
+
+typedef struct {
+    const char *name;
+    int (*init)(void);
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+    void *(*calloc)(size_t nmemb, size_t size);
+    void *(*memalign)(size_t alignment, size_t size);
+    void *(*aligned_alloc)(size_t alignment, size_t size);
+    void (*stats)(mm_stats_t *stats);
+    void (*footprint)(mm_footprint_t *fp);
+    int (*lock_stats)(mm_lock_stats_t *stats);
+    int (*profile_dump)(FILE *fp, const char *label);
+} mm_variant_t;
+
+extern const mm_variant_t mm_variants[];
+extern const int mm_num_variants;
+
+/* Number of memlib arenas that the mm packages use, for mem_set_arenas */
+extern const int mm_num_arenas;